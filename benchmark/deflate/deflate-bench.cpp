@@ -0,0 +1,97 @@
+// Host benchmark for PsychicDeflate: CPU time versus bytes saved for a few window / memLevel settings.
+//
+// Build and run (add -DWITH_ZLIB -lz to verify the output and compare against zlib):
+//   g++ -O2 -I../../src deflate-bench.cpp ../../src/PsychicDeflate.cpp -o deflate-bench
+//   ./deflate-bench file.json page.html ...
+
+#include "PsychicDeflate.h"
+#include <chrono>
+#include <fstream>
+#include <iterator>
+#include <stdio.h>
+#include <string>
+#include <vector>
+
+#ifdef WITH_ZLIB
+  #include <zlib.h>
+#endif
+
+#define CHUNK_SIZE 1024 // what a ChunkPrinter hands over per sendChunk()
+#define ROUNDS     20
+
+static std::string compress(const std::string& input, int windowBits, int memLevel)
+{
+  std::string output;
+  PsychicDeflate deflate(windowBits, memLevel);
+  deflate.begin([&output](const uint8_t* data, size_t len) {
+    output.append((const char*)data, len);
+    return 0;
+  });
+
+  for (size_t pos = 0; pos < input.size(); pos += CHUNK_SIZE)
+    deflate.write((const uint8_t*)input.data() + pos, std::min((size_t)CHUNK_SIZE, input.size() - pos));
+  deflate.finish();
+
+  return output;
+}
+
+#ifdef WITH_ZLIB
+static bool verify(const std::string& input, const std::string& gz)
+{
+  std::string output(input.size() + 1, '\0');
+  z_stream zs = {};
+  inflateInit2(&zs, 16 + MAX_WBITS);
+  zs.next_in = (Bytef*)gz.data();
+  zs.avail_in = gz.size();
+  zs.next_out = (Bytef*)&output[0];
+  zs.avail_out = output.size();
+  int ret = inflate(&zs, Z_FINISH);
+  output.resize(zs.total_out);
+  inflateEnd(&zs);
+  return ret == Z_STREAM_END && output == input;
+}
+
+static size_t zlibSize(const std::string& input, int level)
+{
+  uLongf len = compressBound(input.size());
+  std::vector<Bytef> out(len);
+  compress2(out.data(), &len, (const Bytef*)input.data(), input.size(), level);
+  return len;
+}
+#endif
+
+int main(int argc, char** argv)
+{
+  static const int settings[][2] = {{9, 1}, {10, 2}, {11, 3}, {12, 4}, {13, 6}, {15, 8}};
+
+  for (int i = 1; i < argc; i++) {
+    std::ifstream file(argv[i], std::ios::binary);
+    std::string input((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+    if (input.empty())
+      continue;
+
+    printf("%s: %zu bytes\n", argv[i], input.size());
+    printf("  window mem    ram     out  saved    MB/s\n");
+
+    for (auto& s : settings) {
+      std::string gz;
+      auto start = std::chrono::steady_clock::now();
+      for (int r = 0; r < ROUNDS; r++)
+        gz = compress(input, s[0], s[1]);
+      double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+      printf("  %6d %3d %6zu %7zu %5.1f%% %7.1f", s[0], s[1], PsychicDeflate::memoryUsage(s[0], s[1]), gz.size(),
+        100.0 * (1.0 - (double)gz.size() / input.size()), input.size() * ROUNDS / secs / 1e6);
+#ifdef WITH_ZLIB
+      printf("  %s", verify(input, gz) ? "ok" : "MISMATCH");
+#endif
+      printf("\n");
+    }
+
+#ifdef WITH_ZLIB
+    printf("  zlib -1: %zu, zlib -6: %zu\n", zlibSize(input, 1), zlibSize(input, 6));
+#endif
+  }
+
+  return 0;
+}
@@ -0,0 +1,24 @@
+#!/usr/bin/env bash
+# Times downloads of one file through the benchmark server (see README.md).
+#   ./bench.sh [size in MB] [rounds] [port]
+
+SIZE_MB=${1:-16}
+ROUNDS=${2:-50}
+PORT=${3:-${BENCH_PORT:-8080}}
+ROOT=${BENCH_ROOT:-/tmp/psychic-bench}
+
+mkdir -p $ROOT
+if [ ! -f $ROOT/bench.bin ] || [ $(stat -c %s $ROOT/bench.bin) -ne $((SIZE_MB * 1024 * 1024)) ]; then
+  head -c $((SIZE_MB * 1024 * 1024)) /dev/urandom > $ROOT/bench.bin
+fi
+
+# one request first, so the metadata cache is warm
+curl -s -o /dev/null "http://127.0.0.1:$PORT/bench.bin" || { echo "server not running on port $PORT"; exit 1; }
+
+START=$(date +%s.%N)
+for i in $(seq $ROUNDS); do
+  curl -s -o /dev/null "http://127.0.0.1:$PORT/bench.bin"
+done
+END=$(date +%s.%N)
+
+awk -v s=$START -v e=$END -v n=$ROUNDS -v mb=$SIZE_MB 'BEGIN { printf "%d x %dMB: %.1f ms per download\n", n, mb, (e - s) * 1000 / n }'
@@ -0,0 +1,24 @@
+// Serves a directory through serveStatic() on the Linux target, so bench.sh times the real
+// PsychicStaticFileHandler / PsychicFileResponse path. Build it once as it is (sendfile()) and
+// once with -DPSYCHIC_SENDFILE=0 (pool buffer + httpd_send()) to compare the two.
+
+#include <PsychicHttp.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+PsychicHttpServer server;
+
+extern "C" void app_main()
+{
+  const char* root = getenv("BENCH_ROOT");
+  const char* port = getenv("BENCH_PORT");
+
+  server.setPort(port ? atoi(port) : 8080);
+  server.serveStatic("/", root ? root : "/tmp/psychic-bench");
+  server.start();
+
+  ESP_LOGI(PH_TAG, "Serving %s on port %s, sendfile %s", root ? root : "/tmp/psychic-bench", port ? port : "8080", PSYCHIC_SENDFILE ? "on" : "off");
+
+  while (true)
+    sleep(60);
+}
@@ -1,27 +1,34 @@
 #include "ChunkPrinter.h"
+#include "freertos/task.h"
 
 ChunkPrinter::ChunkPrinter(PsychicResponse* response, uint8_t* buffer, size_t len) : _response(response),
                                                                                      _buffer(buffer),
                                                                                      _length(len),
-                                                                                     _pos(0)
+                                                                                     _pos(0),
+                                                                                     _flushMinSize(STREAM_FLUSH_MIN_SIZE),
+                                                                                     _flushInterval(pdMS_TO_TICKS(STREAM_FLUSH_INTERVAL_MS)),
+                                                                                     _lastSend(xTaskGetTickCount())
 {
 }
 
 ChunkPrinter::~ChunkPrinter()
 {
-  flush();
+  finish();
 }
 
-size_t ChunkPrinter::write(uint8_t c)
+esp_err_t ChunkPrinter::_sendBuffer()
 {
-  esp_err_t err;
+  esp_err_t err = _response->sendChunk(_buffer, _pos);
+  _pos = 0;
+  _lastSend = xTaskGetTickCount();
+  return err;
+}
 
+size_t ChunkPrinter::write(uint8_t c)
+{
   // if we're full, send a chunk
   if (_pos == _length) {
-    _pos = 0;
-    err = _response->sendChunk(_buffer, _length);
-
-    if (err != ESP_OK)
+    if (_sendBuffer() != ESP_OK)
       return 0;
   }
 
@@ -35,16 +42,24 @@ size_t ChunkPrinter::write(const uint8_t* buffer, size_t size)
   size_t written = 0;
 
   while (written < size) {
+    size_t remaining = size - written;
+
+    // nothing buffered and at least a whole chunk to go: send straight from the caller's memory
+    if (_pos == 0 && remaining >= _length) {
+      if (_response->sendChunk((uint8_t*)buffer + written, remaining) != ESP_OK)
+        return written;
+      _lastSend = xTaskGetTickCount();
+      return size;
+    }
+
     size_t space = _length - _pos;
-    size_t blockSize = std::min(space, size - written);
+    size_t blockSize = std::min(space, remaining);
 
     memcpy(_buffer + _pos, buffer + written, blockSize);
     _pos += blockSize;
 
     if (_pos == _length) {
-      _pos = 0;
-
-      if (_response->sendChunk(_buffer, _length) != ESP_OK)
+      if (_sendBuffer() != ESP_OK)
         return written;
     }
     written += blockSize; // Update if sent correctly.
@@ -52,12 +67,45 @@ size_t ChunkPrinter::write(const uint8_t* buffer, size_t size)
   return written;
 }
 
-void ChunkPrinter::flush()
+uint8_t* ChunkPrinter::reserve(size_t len)
 {
-  if (_pos) {
-    _response->sendChunk(_buffer, _pos);
-    _pos = 0;
+  if (len > _length)
+    return nullptr;
+
+  if (_length - _pos < len) {
+    if (_sendBuffer() != ESP_OK)
+      return nullptr;
   }
+
+  return _buffer + _pos;
+}
+
+void ChunkPrinter::commit(size_t used)
+{
+  _pos = std::min(_pos + used, _length);
+}
+
+void ChunkPrinter::setFlushPolicy(size_t minSize, uint32_t intervalMs)
+{
+  _flushMinSize = minSize;
+  _flushInterval = pdMS_TO_TICKS(intervalMs);
+}
+
+void ChunkPrinter::flush()
+{
+  if (!_pos)
+    return;
+
+  if (_pos >= _flushMinSize || (TickType_t)(xTaskGetTickCount() - _lastSend) >= _flushInterval)
+    _sendBuffer();
+}
+
+esp_err_t ChunkPrinter::finish()
+{
+  if (!_pos)
+    return ESP_OK;
+
+  return _sendBuffer();
 }
 
 #ifdef ARDUINO
@@ -65,17 +113,15 @@ size_t ChunkPrinter::copyFrom(Stream& stream)
 {
   size_t count = 0;
 
-  while (stream.available()) {
+  while (stream.available() > 0) {
 
-    if (_pos == _length) {
-      _response->sendChunk(_buffer, _length);
-      _pos = 0;
-    }
+    if (_pos == _length)
+      _sendBuffer();
 
-    size_t readBytes = stream.readBytes(_buffer + _pos, _length - _pos);
+    size_t readBytes = stream.readBytes(_buffer + _pos, std::min(_length - _pos, (size_t)stream.available()));
     _pos += readBytes;
     count += readBytes;
   }
   return count;
 }
-#endif // ARDUINO
\ No newline at end of file
+#endif // ARDUINO
@@ -3,6 +3,17 @@
 
 #include "PsychicPrint.h"
 #include "PsychicResponse.h"
+#include "freertos/FreeRTOS.h"
+
+// A flush() only sends a chunk once this many bytes are buffered (0: every flush() sends)...
+#ifndef STREAM_FLUSH_MIN_SIZE
+  #define STREAM_FLUSH_MIN_SIZE 0
+#endif
+
+// ...or the last chunk went out at least this long ago (ms).
+#ifndef STREAM_FLUSH_INTERVAL_MS
+  #define STREAM_FLUSH_INTERVAL_MS 100
+#endif
 
 class ChunkPrinter : public Print
 {
@@ -12,6 +23,12 @@ class ChunkPrinter : public Print
     size_t _length;
     size_t _pos;
 
+    size_t _flushMinSize;
+    TickType_t _flushInterval;
+    TickType_t _lastSend;
+
+    esp_err_t _sendBuffer();
+
   public:
     ChunkPrinter(PsychicResponse* response, uint8_t* buffer, size_t len);
     ~ChunkPrinter();
@@ -23,7 +40,23 @@ class ChunkPrinter : public Print
     size_t copyFrom(Stream& stream);
 #endif
 
+    // Format directly into the chunk buffer: reserve() returns room for at least len
+    // contiguous bytes (sending what is buffered first if needed, nullptr if len is
+    // larger than the buffer), commit() then marks how many of them were written.
+    uint8_t* reserve(size_t len);
+    void commit(size_t used);
+
+    // By default flush() sends whatever is buffered. With a minSize it becomes a hint
+    // that only sends once minSize bytes are buffered or the last chunk is intervalMs
+    // old, so chatty writers produce larger chunks. The interval is only checked when
+    // flush() is called, so a small tail waits for the next flush() or finish().
+    void setFlushPolicy(size_t minSize, uint32_t intervalMs);
     void flush() override;
+
+    // send everything that is buffered, regardless of the flush policy
+    esp_err_t finish();
+    // forget what is buffered without sending it
+    void discard() { _pos = 0; }
 };
 
-#endif // ChunkPrinter_h
\ No newline at end of file
+#endif // ChunkPrinter_h
@@ -1,4 +1,5 @@
 #include "MultipartProcessor.h"
+#include "PsychicHttpServer.h"
 #include "PsychicRequest.h"
 #include <algorithm>
 #include <strings.h>
@@ -30,11 +31,23 @@ MultipartProcessor::MultipartProcessor(PsychicRequest* request, PsychicUploadCal
                                                                                                         _itemType(),
                                                                                                         _itemValue(),
                                                                                                         _itemBuffer(0),
+                                                                                                        _itemBufferSize(0),
                                                                                                         _itemBufferIndex(0),
-                                                                                                        _itemIsFile(false)
+                                                                                                        _itemIsFile(false),
+                                                                                                        _noBuffer(false)
 {
 }
-MultipartProcessor::~MultipartProcessor() {}
+MultipartProcessor::~MultipartProcessor()
+{
+  _releaseItemBuffer();
+}
+
+void MultipartProcessor::_releaseItemBuffer()
+{
+  if (_itemBuffer)
+    _request->server()->bufferPool.release(_itemBuffer);
+  _itemBuffer = NULL;
+}
 
 esp_err_t MultipartProcessor::process()
 {
@@ -54,7 +67,11 @@ esp_err_t MultipartProcessor::process()
     return ESP_ERR_HTTPD_INVALID_REQ;
   }
 
-  char* buf = (char*)malloc(FILE_CHUNK_SIZE);
+  // any size will do for reading, the parser goes byte by byte
+  PsychicPooledBuffer buffer(&_request->server()->bufferPool, PSYCHIC_POOL_SMALL_SIZE, FILE_CHUNK_SIZE);
+  if (!buffer)
+    return ESP_ERR_NO_MEM;
+  char* buf = (char*)buffer.data();
   int received;
   unsigned long index = 0;
 
@@ -67,7 +84,7 @@ esp_err_t MultipartProcessor::process()
 #endif
 
     /* Receive the file part by part into a buffer */
-    if ((received = httpd_req_recv(_request->request(), buf, std::min(remaining, (int)FILE_CHUNK_SIZE))) <= 0) {
+    if ((received = httpd_req_recv(_request->request(), buf, std::min(remaining, (int)buffer.size()))) <= 0) {
       /* Retry if timeout occurred */
       if (received == HTTPD_SOCK_ERR_TIMEOUT)
         continue;
@@ -91,8 +108,8 @@ esp_err_t MultipartProcessor::process()
     }
   }
 
-  // dont forget to free our buffer
-  free(buf);
+  if (_noBuffer)
+    err = ESP_ERR_NO_MEM;
 
   return err;
 }
@@ -120,6 +137,9 @@ esp_err_t MultipartProcessor::process(const char* body)
     _parsedLength++;
   }
 
+  if (_noBuffer)
+    err = ESP_ERR_NO_MEM;
+
   return err;
 }
 
@@ -127,7 +147,7 @@ void MultipartProcessor::_handleUploadByte(uint8_t data, bool last)
 {
   _itemBuffer[_itemBufferIndex++] = data;
 
-  if (last || _itemBufferIndex == FILE_CHUNK_SIZE) {
+  if (last || _itemBufferIndex == _itemBufferSize) {
     if (_uploadCallback)
       _uploadCallback(_request, _itemFilename.c_str(), _itemSize - _itemBufferIndex, _itemBuffer, _itemBufferIndex, last);
 
@@ -148,10 +168,7 @@ void MultipartProcessor::_parseMultipartPostByte(uint8_t data, bool last)
 {
   if (_multiParseState == PARSE_ERROR) {
     // not sure we can end up with an error during buffer fill, but jsut to be safe
-    if (_itemBuffer != NULL) {
-      free(_itemBuffer);
-      _itemBuffer = NULL;
-    }
+    _releaseItemBuffer();
 
     return;
   }
@@ -229,11 +246,11 @@ void MultipartProcessor::_parseMultipartPostByte(uint8_t data, bool last)
         _itemStartIndex = _parsedLength;
         _itemValue.clear();
         if (_itemIsFile) {
-          if (_itemBuffer)
-            free(_itemBuffer);
-          _itemBuffer = (uint8_t*)malloc(FILE_CHUNK_SIZE);
+          _releaseItemBuffer();
+          _itemBuffer = _request->server()->bufferPool.acquire(PSYCHIC_POOL_SMALL_SIZE, FILE_CHUNK_SIZE, _itemBufferSize);
           if (_itemBuffer == NULL) {
             ESP_LOGE(PH_TAG, "Multipart: Failed to allocate buffer");
+            _noBuffer = true;
             _multiParseState = PARSE_ERROR;
             return;
           }
@@ -295,8 +312,7 @@ void MultipartProcessor::_parseMultipartPostByte(uint8_t data, bool last)
           // External - Add parameter!
           _request->addParam(new PsychicWebParameter(_itemName.c_str(), _itemFilename.c_str(), true, true, _itemSize));
         }
-        free(_itemBuffer);
-        _itemBuffer = NULL;
+        _releaseItemBuffer();
       }
     } else {
       _boundaryPosition++;
@@ -25,10 +25,13 @@ class MultipartProcessor
     std::string _itemFilename;
     std::string _itemType;
     std::string _itemValue;
-    uint8_t* _itemBuffer;
+    uint8_t* _itemBuffer; // from the server's buffer pool
+    size_t _itemBufferSize;
     size_t _itemBufferIndex;
     bool _itemIsFile;
+    bool _noBuffer;
 
+    void _releaseItemBuffer();
     void _handleUploadByte(uint8_t data, bool last);
     void _parseMultipartPostByte(uint8_t data, bool last);
 
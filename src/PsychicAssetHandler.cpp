@@ -0,0 +1,151 @@
+#include "PsychicAssetHandler.h"
+
+// indexed by PsychicAssetEncoding
+static const char* assetCodings[] = {"identity", "gzip", "br"};
+
+// compare a NUL terminated path against key + suffix without building the key
+static int compareKey(const char* path, const char* key, size_t len, const char* suffix)
+{
+  for (size_t i = 0; i < len; i++, path++) {
+    if (*path != key[i])
+      return (uint8_t)*path - (uint8_t)key[i];
+  }
+  return strcmp(path, suffix);
+}
+
+PsychicAssetHandler::PsychicAssetHandler(const char* uri, const PsychicAsset* assets, size_t count, const char* cache_control) : _uri(uri),
+                                                                                                                               _defaultFile("index.html"),
+                                                                                                                               _cacheControl(cache_control ? cache_control : ""),
+                                                                                                                               _assets(assets),
+                                                                                                                               _count(count)
+{
+  // asset paths start with '/', so the mount point must not end with one
+  while (!_uri.empty() && _uri.back() == '/')
+    _uri.pop_back();
+}
+
+PsychicAssetHandler* PsychicAssetHandler::setDefaultFile(const char* filename)
+{
+  _defaultFile = filename;
+  while (!_defaultFile.empty() && _defaultFile[0] == '/')
+    _defaultFile.erase(0, 1);
+  return this;
+}
+
+PsychicAssetHandler* PsychicAssetHandler::setCacheControl(const char* cache_control)
+{
+  _cacheControl = cache_control;
+  return this;
+}
+
+size_t PsychicAssetHandler::_find(const char* key, size_t len, const char* suffix, size_t& count)
+{
+  size_t low = 0;
+  size_t high = _count;
+  while (low < high) {
+    size_t mid = (low + high) / 2;
+    if (compareKey(_path(mid), key, len, suffix) < 0)
+      low = mid + 1;
+    else
+      high = mid;
+  }
+
+  count = 0;
+  while (low + count < _count && compareKey(_path(low + count), key, len, suffix) == 0)
+    count++;
+
+  return low;
+}
+
+bool PsychicAssetHandler::canHandle(PsychicRequest* request)
+{
+  if (request->method() != HTTP_GET)
+    return false;
+  if (!_count)
+    return false;
+
+  // "/app" covers "/app", "/app/..." and "/app?..." but not "/apple"
+  const char* uri = request->uriCStr();
+  if (strncmp(uri, _uri.c_str(), _uri.length()) != 0)
+    return false;
+  char next = uri[_uri.length()];
+  if (next != '\0' && next != '/' && next != '?')
+    return false;
+
+  // paths we don't have go to the next handler, without running our middleware
+  size_t count;
+  _lookup(request, count);
+  return count > 0;
+}
+
+size_t PsychicAssetHandler::_lookup(PsychicRequest* request, size_t& count)
+{
+  const char* path = request->uriCStr() + _uri.length();
+  size_t len = strcspn(path, "?");
+
+  // percent-encoded names are rare, only they pay for decoding
+  std::string decoded;
+  if (memchr(path, '%', len)) {
+    decoded = urlDecode(std::string(path, len).c_str()).c_str();
+    path = decoded.c_str();
+    len = decoded.length();
+  }
+
+  // directories get their default file
+  const char* suffix = "";
+  if (len == 0) {
+    path = "/";
+    len = 1;
+  }
+  if (path[len - 1] == '/')
+    suffix = _defaultFile.c_str();
+
+  return _find(path, len, suffix, count);
+}
+
+esp_err_t PsychicAssetHandler::handleRequest(PsychicRequest* request, PsychicResponse* response)
+{
+  // a binary search again is cheaper than keeping canHandle()'s answer around
+  size_t count;
+  size_t first = _lookup(request, count);
+  if (!count)
+    return HTTPD_404_NOT_FOUND;
+
+  // best representation the client takes. if it takes none, there are only encoded
+  // copies and sending one beats a 404.
+  PsychicAsset asset;
+  _asset(first, asset);
+  bool anyCoding = !request->hasHeader("Accept-Encoding");
+  bool found = false;
+  for (int encoding : {ASSET_BR, ASSET_GZIP, ASSET_IDENTITY}) {
+    if (encoding != ASSET_IDENTITY && !request->acceptsEncoding(assetCodings[encoding]) && !(anyCoding && encoding == ASSET_GZIP))
+      continue;
+    for (size_t i = first; i < first + count && !found; i++) {
+      PsychicAsset candidate;
+      _asset(i, candidate);
+      if (candidate.encoding == encoding) {
+        asset = candidate;
+        found = true;
+      }
+    }
+    if (found)
+      break;
+  }
+
+  response->addHeader("ETag", asset.etag);
+  if (_cacheControl.length())
+    response->addHeader("Cache-Control", _cacheControl.c_str());
+  if (count > 1)
+    response->addHeader("Vary", "Accept-Encoding");
+
+  if (request->hasHeader("If-None-Match") && etagMatches(request->headerCStr("If-None-Match"), asset.etag))
+    return response->send(304);
+
+  if (asset.encoding != ASSET_IDENTITY) {
+    response->addHeader("Content-Encoding", assetCodings[asset.encoding]);
+    // already compressed, enableCompression() must not have another go at it
+    response->disableCompression();
+  }
+
+  return response->send(200, asset.type, asset.data, asset.length);
+}
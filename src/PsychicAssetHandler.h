@@ -0,0 +1,77 @@
+#ifndef PsychicAssetHandler_h
+#define PsychicAssetHandler_h
+
+#include "PsychicCore.h"
+#include "PsychicRequest.h"
+#include "PsychicResponse.h"
+#include "PsychicWebHandler.h"
+
+enum PsychicAssetEncoding {
+  ASSET_IDENTITY = 0,
+  ASSET_GZIP = 1,
+  ASSET_BR = 2
+};
+
+// One representation of a file compiled into the firmware. Tables are written by
+// tools/embed_assets.py, sorted by path then encoding.
+struct PsychicAsset {
+    const char* path;
+    const char* type;
+    const char* etag; // quoted
+    const uint8_t* data;
+    size_t length;
+    uint8_t encoding;
+};
+
+// compile-time checks for generated tables, kept to single returns so they work with C++11
+constexpr int psychicAssetCompare(const char* a, const char* b)
+{
+  return *a != *b ? (uint8_t)*a - (uint8_t)*b : *a ? psychicAssetCompare(a + 1, b + 1) : 0;
+}
+
+// splits the table in halves rather than recursing once per entry, so the depth stays at
+// log2(count) and large tables don't hit the compiler's constexpr depth limit
+constexpr bool psychicAssetsSorted(const PsychicAsset* assets, size_t count)
+{
+  return count < 2 || (psychicAssetsSorted(assets, count / 2) &&
+                        psychicAssetCompare(assets[count / 2 - 1].path, assets[count / 2].path) <= 0 &&
+                        psychicAssetsSorted(assets + count / 2, count - count / 2));
+}
+
+// Serves a sorted PsychicAsset table straight from flash, with no filesystem involved.
+// Paths not in the table fall through to the next handler.
+class PsychicAssetHandler : public PsychicWebHandler
+{
+  protected:
+    std::string _uri;
+    std::string _defaultFile;
+    std::string _cacheControl;
+
+    const PsychicAsset* _assets;
+    size_t _count;
+
+    // PsychicBundleHandler keeps its entries in another layout
+    virtual const char* _path(size_t index) { return _assets[index].path; }
+    virtual void _asset(size_t index, PsychicAsset& asset) { asset = _assets[index]; }
+
+    // index of the first representation of key + suffix, count is how many there are
+    size_t _find(const char* key, size_t len, const char* suffix, size_t& count);
+    // the representations of the requested path, count is 0 if it isn't in the table
+    size_t _lookup(PsychicRequest* request, size_t& count);
+
+  public:
+    PsychicAssetHandler(const char* uri, const PsychicAsset* assets, size_t count, const char* cache_control = nullptr);
+    template <size_t N>
+    PsychicAssetHandler(const char* uri, const PsychicAsset (&assets)[N], const char* cache_control = nullptr) : PsychicAssetHandler(uri, assets, N, cache_control) {}
+    virtual ~PsychicAssetHandler() {}
+
+    bool canHandle(PsychicRequest* request) override;
+    esp_err_t handleRequest(PsychicRequest* request, PsychicResponse* response) override;
+
+    size_t count() { return _count; }
+
+    PsychicAssetHandler* setDefaultFile(const char* filename);
+    PsychicAssetHandler* setCacheControl(const char* cache_control);
+};
+
+#endif // PsychicAssetHandler_h
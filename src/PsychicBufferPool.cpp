@@ -0,0 +1,415 @@
+#include "PsychicBufferPool.h"
+
+PsychicBufferPool::PsychicBufferPool() : _classes(), _waiting(0), _stats()
+{
+  setClass(0, PSYCHIC_POOL_SMALL_SIZE, PSYCHIC_POOL_SMALL_COUNT);
+  setClass(1, PSYCHIC_POOL_MEDIUM_SIZE, PSYCHIC_POOL_MEDIUM_COUNT);
+  setClass(2, PSYCHIC_POOL_LARGE_SIZE, PSYCHIC_POOL_LARGE_COUNT);
+
+  _lock = xSemaphoreCreateMutex();
+  _released = xSemaphoreCreateCounting(32 * PSYCHIC_POOL_CLASSES, 0);
+}
+
+PsychicBufferPool::~PsychicBufferPool()
+{
+  end();
+  for (SizeClass& c : _classes)
+    for (uint8_t* buffer : c.buffers)
+      free(buffer);
+  vSemaphoreDelete(_lock);
+  vSemaphoreDelete(_released);
+}
+
+void PsychicBufferPool::setClass(int index, size_t size, size_t count)
+{
+  if (index < 0 || index >= PSYCHIC_POOL_CLASSES)
+    return;
+  for (uint8_t* buffer : _classes[index].buffers)
+    if (buffer)
+      return;
+
+  _classes[index].size = size;
+  _classes[index].count = count > 32 ? 32 : count;
+  _classes[index].used = 0;
+}
+
+// one buffer at a time, a small block is easier to find on a fragmented heap. Called locked.
+bool PsychicBufferPool::_allocate(SizeClass& c, size_t slot)
+{
+  c.buffers[slot] = (uint8_t*)malloc(c.size);
+  if (c.buffers[slot])
+    return true;
+
+  ESP_LOGE(PH_TAG, "Buffer pool: unable to allocate a %u byte buffer", (unsigned)c.size);
+  return false;
+}
+
+bool PsychicBufferPool::begin(bool preallocate)
+{
+  if (!preallocate)
+    return true;
+
+  bool ok = true;
+  xSemaphoreTake(_lock, portMAX_DELAY);
+  for (SizeClass& c : _classes) {
+    for (size_t slot = 0; slot < c.count; slot++)
+      if (!c.buffers[slot])
+        ok = _allocate(c, slot) && ok;
+  }
+  xSemaphoreGive(_lock);
+
+  return ok;
+}
+
+void PsychicBufferPool::end()
+{
+  xSemaphoreTake(_lock, portMAX_DELAY);
+  for (SizeClass& c : _classes) {
+    // a request that outlived the server (an async worker) still has one, keep it
+    if (c.used)
+      ESP_LOGE(PH_TAG, "Buffer pool: %u byte buffers are still in use, keeping them", (unsigned)c.size);
+    for (size_t slot = 0; slot < c.count; slot++) {
+      if (c.used & (1u << slot))
+        continue;
+      free(c.buffers[slot]);
+      c.buffers[slot] = nullptr;
+    }
+  }
+  xSemaphoreGive(_lock);
+}
+
+// best fit for wantSize, else the biggest free buffer that still holds minSize. Called locked.
+uint8_t* PsychicBufferPool::_take(size_t minSize, size_t wantSize, size_t& size)
+{
+  uint32_t failed = 0; // classes we couldn't allocate a buffer for this time
+
+  while (true) {
+    SizeClass* best = nullptr;
+    for (SizeClass& c : _classes) {
+      if (!c.count || c.size < minSize || c.used == ((uint64_t)1 << c.count) - 1 || (failed & (1u << (&c - _classes))))
+        continue;
+      if (!best)
+        best = &c;
+      else if (best->size < wantSize ? c.size > best->size : c.size >= wantSize && c.size < best->size)
+        best = &c;
+    }
+    if (!best)
+      return nullptr;
+
+    // a free buffer we already have, else the first slot that still needs one
+    size_t slot = best->count;
+    for (size_t i = 0; i < best->count; i++) {
+      if (best->used & (1u << i))
+        continue;
+      if (best->buffers[i]) {
+        slot = i;
+        break;
+      }
+      if (slot == best->count)
+        slot = i;
+    }
+    if (!best->buffers[slot] && !_allocate(*best, slot)) {
+      failed |= 1u << (best - _classes);
+      continue;
+    }
+    best->used |= 1u << slot;
+
+    size = best->size;
+    _stats.acquired++;
+    if (size < wantSize)
+      _stats.downsized++;
+    if (++_stats.inUse > _stats.peak)
+      _stats.peak = _stats.inUse;
+
+    return best->buffers[slot];
+  }
+}
+
+uint8_t* PsychicBufferPool::acquire(size_t minSize, size_t wantSize, size_t& size, TickType_t wait)
+{
+  if (wantSize < minSize)
+    wantSize = minSize;
+
+  // nothing here will ever be big enough
+  bool fits = false;
+  xSemaphoreTake(_lock, portMAX_DELAY);
+  for (SizeClass& c : _classes)
+    fits = fits || (c.count && c.size >= minSize);
+  xSemaphoreGive(_lock);
+  if (!fits) {
+    uint8_t* buffer = (uint8_t*)malloc(wantSize);
+    size = buffer ? wantSize : 0;
+    xSemaphoreTake(_lock, portMAX_DELAY);
+    _stats.heap++;
+    xSemaphoreGive(_lock);
+    return buffer;
+  }
+
+  TickType_t start = xTaskGetTickCount();
+  bool waited = false;
+  while (true) {
+    xSemaphoreTake(_lock, portMAX_DELAY);
+    if (waited)
+      _waiting--;
+    // nobody else is waiting, so any token left over is stale
+    if (!_waiting)
+      while (xSemaphoreTake(_released, 0) == pdTRUE)
+        ;
+
+    uint8_t* buffer = _take(minSize, wantSize, size);
+    TickType_t elapsed = xTaskGetTickCount() - start;
+    bool giveUp = !buffer && elapsed >= wait;
+    if ((buffer || giveUp) && waited)
+      _stats.waited++;
+    if (giveUp)
+      _stats.exhausted++;
+    if (!buffer && !giveUp)
+      _waiting++;
+    xSemaphoreGive(_lock);
+
+    if (buffer)
+      return buffer;
+    if (giveUp) {
+      ESP_LOGE(PH_TAG, "Buffer pool exhausted, no %u byte buffer came back in time", (unsigned)minSize);
+      size = 0;
+      return nullptr;
+    }
+
+    // a release may be for a class we can't use, so look again either way
+    waited = true;
+    xSemaphoreTake(_released, wait - elapsed);
+  }
+}
+
+void PsychicBufferPool::release(uint8_t* buffer)
+{
+  if (!buffer)
+    return;
+
+  xSemaphoreTake(_lock, portMAX_DELAY);
+  for (SizeClass& c : _classes) {
+    for (size_t slot = 0; slot < c.count; slot++) {
+      if (c.buffers[slot] != buffer)
+        continue;
+      c.used &= ~(1u << slot);
+      _stats.inUse--;
+      if (_waiting)
+        xSemaphoreGive(_released);
+      xSemaphoreGive(_lock);
+      return;
+    }
+  }
+  xSemaphoreGive(_lock);
+
+  // one of the oversized ones
+  free(buffer);
+}
+
+PsychicBufferPoolStats PsychicBufferPool::stats()
+{
+  xSemaphoreTake(_lock, portMAX_DELAY);
+  PsychicBufferPoolStats stats = _stats;
+  xSemaphoreGive(_lock);
+  return stats;
+}
+
+size_t PsychicBufferPool::classInUse(int index)
+{
+  xSemaphoreTake(_lock, portMAX_DELAY);
+  size_t count = __builtin_popcount(_classes[index].used);
+  xSemaphoreGive(_lock);
+  return count;
+}
+
+PsychicSlabPool::PsychicSlabPool() : _classes(), _caps(PSYCHIC_SLAB_CAPS), _stats()
+{
+  setClass(0, PSYCHIC_SLAB_SMALL_SIZE, PSYCHIC_SLAB_SMALL_COUNT);
+  setClass(1, PSYCHIC_SLAB_MEDIUM_SIZE, PSYCHIC_SLAB_MEDIUM_COUNT);
+  setClass(2, PSYCHIC_SLAB_LARGE_SIZE, PSYCHIC_SLAB_LARGE_COUNT);
+
+  _lock = xSemaphoreCreateMutex();
+}
+
+PsychicSlabPool::~PsychicSlabPool()
+{
+  end();
+  for (SizeClass& c : _classes)
+    _heapFree(c.memory);
+  vSemaphoreDelete(_lock);
+}
+
+void PsychicSlabPool::setClass(int index, size_t size, size_t count)
+{
+  if (index < 0 || index >= PSYCHIC_POOL_CLASSES || _classes[index].memory)
+    return;
+
+  // keep every slab 4 byte aligned, ArduinoJson puts its slots in them
+  _classes[index].size = (size + 3) & ~(size_t)3;
+  _classes[index].count = count > 32 ? 32 : count;
+  _classes[index].used = 0;
+  _classes[index].peak = 0;
+}
+
+void PsychicSlabPool::setCaps(uint32_t caps)
+{
+  _caps = caps;
+}
+
+void PsychicSlabPool::end()
+{
+  xSemaphoreTake(_lock, portMAX_DELAY);
+  for (SizeClass& c : _classes) {
+    // a document that outlived the server still lives in it, keep it
+    if (c.used) {
+      ESP_LOGE(PH_TAG, "Slab pool: %u byte slabs are still in use, keeping them", (unsigned)c.size);
+      continue;
+    }
+    _heapFree(c.memory);
+    c.memory = nullptr;
+  }
+  xSemaphoreGive(_lock);
+}
+
+void* PsychicSlabPool::_heapAlloc(size_t size)
+{
+#ifdef CONFIG_IDF_TARGET_LINUX
+  return malloc(size);
+#else
+  return heap_caps_malloc(size, _caps);
+#endif
+}
+
+void PsychicSlabPool::_heapFree(void* ptr)
+{
+#ifdef CONFIG_IDF_TARGET_LINUX
+  free(ptr);
+#else
+  heap_caps_free(ptr);
+#endif
+}
+
+// the class whose block holds ptr, nullptr for heap blocks. Called locked.
+PsychicSlabPool::SizeClass* PsychicSlabPool::_owner(void* ptr)
+{
+  for (SizeClass& c : _classes) {
+    if (c.memory && (uint8_t*)ptr >= c.memory && (uint8_t*)ptr < c.memory + c.size * c.count)
+      return &c;
+  }
+  return nullptr;
+}
+
+void* PsychicSlabPool::allocate(size_t size)
+{
+  xSemaphoreTake(_lock, portMAX_DELAY);
+
+  // classes go from small to large, so the first free one that fits is the best one
+  for (SizeClass& c : _classes) {
+    if (!c.count || c.size < size || c.used == ((uint64_t)1 << c.count) - 1)
+      continue;
+    if (!c.memory) {
+      c.memory = (uint8_t*)_heapAlloc(c.size * c.count);
+      if (!c.memory) {
+        // tried again next time, the heap may have room by then
+        ESP_LOGE(PH_TAG, "Slab pool: unable to allocate %u x %u bytes", (unsigned)c.count, (unsigned)c.size);
+        continue;
+      }
+    }
+
+    size_t slot = 0;
+    while (c.used & (1u << slot))
+      slot++;
+    c.used |= 1u << slot;
+
+    size_t used = __builtin_popcount(c.used);
+    if (used > c.peak)
+      c.peak = used;
+    _stats.allocated++;
+    if (++_stats.inUse > _stats.peak)
+      _stats.peak = _stats.inUse;
+
+    xSemaphoreGive(_lock);
+    return c.memory + slot * c.size;
+  }
+
+  void* ptr = _heapAlloc(size);
+  if (ptr) {
+    _stats.heap++;
+    _stats.heapInUse++;
+  }
+
+  xSemaphoreGive(_lock);
+  return ptr;
+}
+
+void PsychicSlabPool::release(void* ptr)
+{
+  if (!ptr)
+    return;
+
+  xSemaphoreTake(_lock, portMAX_DELAY);
+  SizeClass* c = _owner(ptr);
+  if (c) {
+    c->used &= ~(1u << (((uint8_t*)ptr - c->memory) / c->size));
+    _stats.inUse--;
+  } else
+    _stats.heapInUse--;
+  xSemaphoreGive(_lock);
+
+  if (!c)
+    _heapFree(ptr);
+}
+
+void* PsychicSlabPool::reallocate(void* ptr, size_t size)
+{
+  if (!ptr)
+    return allocate(size);
+
+  xSemaphoreTake(_lock, portMAX_DELAY);
+  SizeClass* c = _owner(ptr);
+  size_t slabSize = c ? c->size : 0;
+  xSemaphoreGive(_lock);
+
+  // growing or shrinking in place, the slab is already big enough
+  if (c && size <= slabSize)
+    return ptr;
+
+  if (!c) {
+#ifdef CONFIG_IDF_TARGET_LINUX
+    return realloc(ptr, size);
+#else
+    return heap_caps_realloc(ptr, size, _caps);
+#endif
+  }
+
+  // outgrew its slab, the old one stays valid if there is nowhere to go
+  void* moved = allocate(size);
+  if (moved) {
+    memcpy(moved, ptr, slabSize);
+    release(ptr);
+  }
+  return moved;
+}
+
+PsychicSlabPoolStats PsychicSlabPool::stats()
+{
+  xSemaphoreTake(_lock, portMAX_DELAY);
+  PsychicSlabPoolStats stats = _stats;
+  xSemaphoreGive(_lock);
+  return stats;
+}
+
+size_t PsychicSlabPool::classInUse(int index)
+{
+  xSemaphoreTake(_lock, portMAX_DELAY);
+  size_t count = __builtin_popcount(_classes[index].used);
+  xSemaphoreGive(_lock);
+  return count;
+}
+
+size_t PsychicSlabPool::classPeak(int index)
+{
+  xSemaphoreTake(_lock, portMAX_DELAY);
+  size_t peak = _classes[index].peak;
+  xSemaphoreGive(_lock);
+  return peak;
+}
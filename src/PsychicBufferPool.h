@@ -0,0 +1,219 @@
+#ifndef PsychicBufferPool_h
+#define PsychicBufferPool_h
+
+#include "PsychicCore.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#ifndef CONFIG_IDF_TARGET_LINUX
+  #include "esp_heap_caps.h"
+#endif
+
+// Transfer buffers come in three size classes. Set a count to 0 to drop that class; with no
+// classes at all every buffer comes from the heap.
+#ifndef PSYCHIC_POOL_SMALL_SIZE
+  #define PSYCHIC_POOL_SMALL_SIZE 1024
+#endif
+#ifndef PSYCHIC_POOL_SMALL_COUNT
+  #define PSYCHIC_POOL_SMALL_COUNT 4
+#endif
+#ifndef PSYCHIC_POOL_MEDIUM_SIZE
+  #define PSYCHIC_POOL_MEDIUM_SIZE 4096
+#endif
+#ifndef PSYCHIC_POOL_MEDIUM_COUNT
+  #define PSYCHIC_POOL_MEDIUM_COUNT 2
+#endif
+#ifndef PSYCHIC_POOL_LARGE_SIZE
+  #define PSYCHIC_POOL_LARGE_SIZE FILE_CHUNK_SIZE
+#endif
+#ifndef PSYCHIC_POOL_LARGE_COUNT
+  #define PSYCHIC_POOL_LARGE_COUNT 2
+#endif
+
+// With PSRAM every buffer is allocated when the server starts, while the heap is still in one
+// piece. Without it each buffer is only allocated the first time it is needed, one at a time, so
+// a server that never sends a large file doesn't hold 16kb of internal RAM for it. A buffer that
+// can't be allocated is tried again on a later acquire().
+#ifndef PSYCHIC_POOL_PREALLOCATE
+  #if defined(CONFIG_SPIRAM) || defined(CONFIG_SPIRAM_SUPPORT)
+    #define PSYCHIC_POOL_PREALLOCATE 1
+  #else
+    #define PSYCHIC_POOL_PREALLOCATE 0
+  #endif
+#endif
+
+// how long a request waits for a buffer to come back before it gets a 503
+#ifndef PSYCHIC_POOL_WAIT_MS
+  #define PSYCHIC_POOL_WAIT_MS 100
+#endif
+
+#define PSYCHIC_POOL_CLASSES 3
+
+struct PsychicBufferPoolStats {
+    size_t inUse;        // buffers out right now
+    size_t peak;         // most buffers out at once
+    uint32_t acquired;   // buffers handed out
+    uint32_t downsized;  // smaller than asked for, because the right class was busy
+    uint32_t waited;     // had to wait for a release
+    uint32_t exhausted;  // nothing came back in time
+    uint32_t heap;       // bigger than any class, so malloc'ed instead
+};
+
+class PsychicBufferPool
+{
+  private:
+    struct SizeClass {
+        size_t size;
+        size_t count;
+        uint8_t* buffers[32]; // nullptr until first used (or begin())
+        uint32_t used;        // one bit per buffer
+    };
+
+    SizeClass _classes[PSYCHIC_POOL_CLASSES];
+    SemaphoreHandle_t _lock;
+    SemaphoreHandle_t _released; // given on release while someone waits
+    size_t _waiting;
+    PsychicBufferPoolStats _stats;
+
+    bool _allocate(SizeClass& c, size_t slot);
+    uint8_t* _take(size_t minSize, size_t wantSize, size_t& size);
+
+  public:
+    PsychicBufferPool();
+    ~PsychicBufferPool();
+
+    // change a class before begin(), count is at most 32
+    void setClass(int index, size_t size, size_t count);
+
+    // Allocate every buffer now (with PSYCHIC_POOL_PREALLOCATE, or preallocate set). Called by
+    // PsychicHttpServer::start(), while the heap is still in one piece.
+    bool begin(bool preallocate = PSYCHIC_POOL_PREALLOCATE);
+    // free every buffer that isn't out, called by PsychicHttpServer::stop()
+    void end();
+
+    // A buffer of at least minSize bytes, and of wantSize if a class that big is free. Waits up
+    // to wait ticks for one to be released; nullptr if none came back (or malloc failed).
+    uint8_t* acquire(size_t minSize, size_t wantSize, size_t& size, TickType_t wait = pdMS_TO_TICKS(PSYCHIC_POOL_WAIT_MS));
+    void release(uint8_t* buffer);
+
+    PsychicBufferPoolStats stats();
+    size_t classSize(int index) { return _classes[index].size; }
+    size_t classCount(int index) { return _classes[index].count; }
+    size_t classInUse(int index);
+};
+
+// holds a buffer from the pool for one scope
+class PsychicPooledBuffer
+{
+  private:
+    PsychicBufferPool* _pool;
+    uint8_t* _data;
+    size_t _size;
+
+  public:
+    PsychicPooledBuffer(PsychicBufferPool* pool, size_t minSize, size_t wantSize) : _pool(pool), _data(nullptr), _size(0)
+    {
+      acquire(minSize, wantSize);
+    }
+    // starts out empty, for when a buffer may not be needed at all
+    explicit PsychicPooledBuffer(PsychicBufferPool* pool) : _pool(pool), _data(nullptr), _size(0) {}
+    ~PsychicPooledBuffer() { _pool->release(_data); }
+
+    bool acquire(size_t minSize, size_t wantSize)
+    {
+      if (!_data)
+        _data = _pool->acquire(minSize, wantSize, _size);
+      return _data != nullptr;
+    }
+
+    PsychicPooledBuffer(const PsychicPooledBuffer&) = delete;
+    PsychicPooledBuffer& operator=(const PsychicPooledBuffer&) = delete;
+
+    uint8_t* data() { return _data; }
+    size_t size() { return _size; }
+    explicit operator bool() const { return _data != nullptr; }
+};
+
+// Slabs for JSON documents, see PsychicJsonAllocator. Unlike the transfer buffers a class is only
+// allocated the first time it is used, then kept, so servers without JSON don't pay for it.
+#ifndef PSYCHIC_SLAB_SMALL_SIZE
+  #define PSYCHIC_SLAB_SMALL_SIZE 64 // strings and the pool list
+#endif
+#ifndef PSYCHIC_SLAB_SMALL_COUNT
+  #define PSYCHIC_SLAB_SMALL_COUNT 32
+#endif
+#ifndef PSYCHIC_SLAB_MEDIUM_SIZE
+  #define PSYCHIC_SLAB_MEDIUM_SIZE 256 // longer strings
+#endif
+#ifndef PSYCHIC_SLAB_MEDIUM_COUNT
+  #define PSYCHIC_SLAB_MEDIUM_COUNT 8
+#endif
+#ifndef PSYCHIC_SLAB_LARGE_SIZE
+  #define PSYCHIC_SLAB_LARGE_SIZE 2048 // one ArduinoJson slot pool
+#endif
+#ifndef PSYCHIC_SLAB_LARGE_COUNT
+  #define PSYCHIC_SLAB_LARGE_COUNT 4
+#endif
+
+// where slabs and oversized blocks come from, e.g. MALLOC_CAP_SPIRAM
+#ifndef PSYCHIC_SLAB_CAPS
+  #ifdef CONFIG_IDF_TARGET_LINUX
+    #define PSYCHIC_SLAB_CAPS 0 // plain malloc() on the host
+  #else
+    #define PSYCHIC_SLAB_CAPS MALLOC_CAP_DEFAULT
+  #endif
+#endif
+
+struct PsychicSlabPoolStats {
+    size_t inUse;       // slabs out right now
+    size_t peak;        // most slabs out at once
+    uint32_t allocated; // slabs handed out
+    uint32_t heap;      // bigger than any class or the class was full, so from the heap instead
+    size_t heapInUse;   // of those, blocks still out
+};
+
+class PsychicSlabPool
+{
+  private:
+    struct SizeClass {
+        size_t size;
+        size_t count;
+        uint8_t* memory;
+        uint32_t used; // one bit per slab
+        size_t peak;
+    };
+
+    SizeClass _classes[PSYCHIC_POOL_CLASSES];
+    uint32_t _caps;
+    SemaphoreHandle_t _lock;
+    PsychicSlabPoolStats _stats;
+
+    SizeClass* _owner(void* ptr);
+    void* _heapAlloc(size_t size);
+    void _heapFree(void* ptr);
+
+  public:
+    PsychicSlabPool();
+    ~PsychicSlabPool();
+
+    // change a class or the memory caps before the first allocation. Count is at most 32,
+    // and the classes must stay smallest first.
+    void setClass(int index, size_t size, size_t count);
+    void setCaps(uint32_t caps);
+
+    // free every class that has no slabs out, busy ones are kept until the next end()
+    void end();
+
+    // malloc() / free() / realloc() semantics, the smallest free slab that fits or the heap
+    void* allocate(size_t size);
+    void release(void* ptr);
+    void* reallocate(void* ptr, size_t size);
+
+    PsychicSlabPoolStats stats();
+    size_t classSize(int index) { return _classes[index].size; }
+    size_t classCount(int index) { return _classes[index].count; }
+    size_t classInUse(int index);
+    // most slabs of this class out at once, size the class from this
+    size_t classPeak(int index);
+};
+
+#endif // PsychicBufferPool_h
@@ -0,0 +1,190 @@
+#include "PsychicBundleHandler.h"
+
+#ifdef CONFIG_IDF_TARGET_LINUX
+  #include <fcntl.h>
+  #include <sys/mman.h>
+  #include <sys/stat.h>
+  #include <unistd.h>
+#elif ESP_IDF_VERSION >= ESP_IDF_VERSION_VAL(5, 0, 0)
+  #define BUNDLE_MUNMAP esp_partition_munmap
+#else
+  // before IDF 5 partitions are mapped through spi_flash, and so are unmapped there too
+  #define BUNDLE_MUNMAP spi_flash_munmap
+#endif
+
+PsychicBundleHandler::PsychicBundleHandler(const char* uri, const char* cache_control) : PsychicAssetHandler(uri, nullptr, 0, cache_control),
+                                                                                        _image(nullptr),
+                                                                                        _imageSize(0),
+                                                                                        _entries(nullptr)
+{
+#ifdef CONFIG_IDF_TARGET_LINUX
+  _mapped = nullptr;
+  _mappedSize = 0;
+#else
+  _mapped = false;
+#endif
+}
+
+PsychicBundleHandler::~PsychicBundleHandler()
+{
+  _unload();
+}
+
+void PsychicBundleHandler::_unload()
+{
+#ifdef CONFIG_IDF_TARGET_LINUX
+  if (_mapped)
+    munmap(_mapped, _mappedSize);
+  _mapped = nullptr;
+  _mappedSize = 0;
+#else
+  if (_mapped)
+    BUNDLE_MUNMAP(_mapHandle);
+  _mapped = false;
+#endif
+
+  _image = nullptr;
+  _imageSize = 0;
+  _entries = nullptr;
+  _count = 0;
+}
+
+esp_err_t PsychicBundleHandler::loadImage(const uint8_t* image, size_t size)
+{
+  _unload();
+  return _loadImage(image, size);
+}
+
+// validates image and starts serving it, whatever was loaded before must be unloaded already
+esp_err_t PsychicBundleHandler::_loadImage(const uint8_t* image, size_t size)
+{
+  const PsychicBundleHeader* header = (const PsychicBundleHeader*)image;
+
+  if ((uintptr_t)image % 4) {
+    ESP_LOGE(PH_TAG, "Bundle image must be 4 byte aligned");
+    return ESP_ERR_INVALID_ARG;
+  }
+  if (size < sizeof(PsychicBundleHeader) || memcmp(header->magic, PSYCHIC_BUNDLE_MAGIC, 4) != 0) {
+    ESP_LOGE(PH_TAG, "Not a bundle image");
+    return ESP_ERR_INVALID_ARG;
+  }
+  if (header->version != PSYCHIC_BUNDLE_VERSION) {
+    ESP_LOGE(PH_TAG, "Bundle version %d is not supported", header->version);
+    return ESP_ERR_NOT_SUPPORTED;
+  }
+  if (header->size > size || sizeof(PsychicBundleHeader) + header->count * sizeof(PsychicBundleEntry) > header->size) {
+    ESP_LOGE(PH_TAG, "Bundle image is truncated (%u of %u bytes)", (unsigned)size, (unsigned)header->size);
+    return ESP_ERR_INVALID_SIZE;
+  }
+
+  // check every offset once here, so serving never has to
+  size = header->size;
+  const PsychicBundleEntry* entries = (const PsychicBundleEntry*)(image + sizeof(PsychicBundleHeader));
+  for (uint16_t i = 0; i < header->count; i++) {
+    const PsychicBundleEntry& e = entries[i];
+    bool ok = e.encoding <= ASSET_BR && e.data <= size && e.length <= size - e.data;
+    for (uint32_t offset : {e.path, e.type, e.etag})
+      ok = ok && offset < size && memchr(image + offset, 0, size - offset);
+    if (ok && i)
+      ok = strcmp((const char*)image + entries[i - 1].path, (const char*)image + e.path) <= 0;
+    if (!ok) {
+      ESP_LOGE(PH_TAG, "Bundle entry %d is corrupt", i);
+      return ESP_ERR_INVALID_STATE;
+    }
+  }
+
+  _image = image;
+  _imageSize = size;
+  _entries = entries;
+  _count = header->count;
+
+  return ESP_OK;
+}
+
+#ifdef CONFIG_IDF_TARGET_LINUX
+esp_err_t PsychicBundleHandler::loadFile(const char* path)
+{
+  _unload();
+
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    ESP_LOGE(PH_TAG, "Cannot open bundle %s", path);
+    return ESP_ERR_NOT_FOUND;
+  }
+
+  struct stat st;
+  void* mapped = MAP_FAILED;
+  if (fstat(fd, &st) == 0 && st.st_size > 0)
+    mapped = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+
+  if (mapped == MAP_FAILED) {
+    ESP_LOGE(PH_TAG, "Cannot map bundle %s", path);
+    return ESP_FAIL;
+  }
+
+  esp_err_t err = _loadImage((const uint8_t*)mapped, st.st_size);
+  if (err != ESP_OK) {
+    munmap(mapped, st.st_size);
+    return err;
+  }
+
+  _mapped = mapped;
+  _mappedSize = st.st_size;
+
+  return ESP_OK;
+}
+#else
+esp_err_t PsychicBundleHandler::loadPartition(const char* label)
+{
+  _unload();
+
+  const esp_partition_t* partition = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_ANY, label);
+  if (!partition) {
+    ESP_LOGE(PH_TAG, "No data partition named %s", label);
+    return ESP_ERR_NOT_FOUND;
+  }
+
+  // only map as much as the image needs, MMU pages are scarce
+  PsychicBundleHeader header;
+  esp_err_t err = esp_partition_read(partition, 0, &header, sizeof(header));
+  if (err != ESP_OK)
+    return err;
+  if (memcmp(header.magic, PSYCHIC_BUNDLE_MAGIC, 4) != 0 || header.size > partition->size) {
+    ESP_LOGE(PH_TAG, "Partition %s does not hold a bundle", label);
+    return ESP_ERR_INVALID_ARG;
+  }
+
+  const void* image;
+  #if ESP_IDF_VERSION >= ESP_IDF_VERSION_VAL(5, 0, 0)
+  err = esp_partition_mmap(partition, 0, header.size, ESP_PARTITION_MMAP_DATA, &image, &_mapHandle);
+  #else
+  err = esp_partition_mmap(partition, 0, header.size, SPI_FLASH_MMAP_DATA, &image, &_mapHandle);
+  #endif
+  if (err != ESP_OK) {
+    ESP_LOGE(PH_TAG, "Cannot map partition %s (%s)", label, esp_err_to_name(err));
+    return err;
+  }
+
+  err = _loadImage((const uint8_t*)image, header.size);
+  if (err != ESP_OK) {
+    BUNDLE_MUNMAP(_mapHandle);
+    return err;
+  }
+
+  _mapped = true;
+
+  return ESP_OK;
+}
+#endif
+
+void PsychicBundleHandler::_asset(size_t index, PsychicAsset& asset)
+{
+  const PsychicBundleEntry& entry = _entries[index];
+  asset.path = _string(entry.path);
+  asset.type = _string(entry.type);
+  asset.etag = _string(entry.etag);
+  asset.data = _image + entry.data;
+  asset.length = entry.length;
+  asset.encoding = entry.encoding;
+}
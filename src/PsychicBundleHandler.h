@@ -0,0 +1,86 @@
+#ifndef PsychicBundleHandler_h
+#define PsychicBundleHandler_h
+
+#include "PsychicAssetHandler.h"
+
+#ifndef CONFIG_IDF_TARGET_LINUX
+  #include "esp_partition.h"
+#endif
+
+// A bundle is one read-only image holding a whole web UI, built by tools/bundle_pack.py.
+// Everything is little endian and every file is looked up in place, nothing is copied.
+//
+//   header   "PSYB", u16 version, u16 entry count, u32 image size
+//   entries  sorted by path then encoding, see PsychicBundleEntry
+//   strings  paths, content types and quoted ETags, NUL terminated
+//   data     file contents, each starting on a 4 byte boundary
+#define PSYCHIC_BUNDLE_MAGIC   "PSYB"
+#define PSYCHIC_BUNDLE_VERSION 1
+
+struct PsychicBundleHeader {
+    char magic[4];
+    uint16_t version;
+    uint16_t count;
+    uint32_t size;
+};
+
+// offsets are from the start of the image
+struct PsychicBundleEntry {
+    uint32_t path;
+    uint32_t type;
+    uint32_t etag;
+    uint32_t data;
+    uint32_t length;
+    uint8_t encoding; // PsychicAssetEncoding
+    uint8_t reserved[3];
+};
+
+// Like PsychicAssetHandler, but the table comes from an image loaded at runtime.
+class PsychicBundleHandler : public PsychicAssetHandler
+{
+  private:
+    const char* _string(uint32_t offset) { return (const char*)_image + offset; }
+    void _unload();
+    esp_err_t _loadImage(const uint8_t* image, size_t size);
+
+  protected:
+    const uint8_t* _image;
+    size_t _imageSize;
+    const PsychicBundleEntry* _entries;
+
+    const char* _path(size_t index) override { return _string(_entries[index].path); }
+    void _asset(size_t index, PsychicAsset& asset) override;
+
+    // whatever loadPartition() / loadFile() mapped, released again by _unload()
+#ifdef CONFIG_IDF_TARGET_LINUX
+    void* _mapped;
+    size_t _mappedSize;
+#else
+  #if ESP_IDF_VERSION >= ESP_IDF_VERSION_VAL(5, 0, 0)
+    esp_partition_mmap_handle_t _mapHandle;
+  #else
+    spi_flash_mmap_handle_t _mapHandle;
+  #endif
+    bool _mapped;
+#endif
+
+  public:
+    PsychicBundleHandler(const char* uri, const char* cache_control = nullptr);
+    ~PsychicBundleHandler();
+
+#ifdef CONFIG_IDF_TARGET_LINUX
+    // map an image file, for running the server on the host
+    esp_err_t loadFile(const char* path);
+#else
+    // map a data partition written with e.g. `parttool.py write_partition --partition-name www --input www.bin`
+    esp_err_t loadPartition(const char* label);
+#endif
+
+    // serve an image that is already in memory, e.g. embedded with EMBED_FILES. It must be
+    // 4 byte aligned and outlive the handler. Every load replaces (and unmaps) the previous image.
+    esp_err_t loadImage(const uint8_t* image, size_t size);
+
+    bool isLoaded() { return _image != nullptr; }
+};
+
+#endif // PsychicBundleHandler_h
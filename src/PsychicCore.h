@@ -4,7 +4,7 @@
 #define PH_TAG "psychic"
 
 #ifndef FILE_CHUNK_SIZE
-  #define FILE_CHUNK_SIZE 8 * 1024
+  #define FILE_CHUNK_SIZE (8 * 1024)
 #endif
 
 #ifndef STREAM_CHUNK_SIZE
@@ -59,6 +59,9 @@ std::string urlEncode(const char* str);
 std::string urlDecode(const char* encoded);
 #endif
 
+// true if an If-None-Match header lists etag (or is "*"). Tags are compared weakly.
+bool etagMatches(const char* header, const char* etag);
+
 // Bounds-safe substring: clamps pos to the string length so it never throws.
 // Arduino String::substring() silently clamped out-of-range positions; std::string::substr()
 // throws std::out_of_range instead, and C++ exceptions are disabled on ESP-IDF builds, so an
@@ -91,6 +94,9 @@ typedef std::function<void(PsychicClient* client)> PsychicClientCallback;
 // callback definitions
 typedef std::function<esp_err_t(PsychicRequest* request, PsychicResponse* response)> PsychicHttpRequestCallback;
 typedef std::function<esp_err_t(PsychicRequest* request, PsychicResponse* response, JsonVariant& json)> PsychicJsonRequestCallback;
+typedef std::function<void(JsonVariant& root)> PsychicJsonFillCallback;
+typedef std::function<bool(size_t index, JsonVariant& record)> PsychicNdjsonCallback;
+typedef std::function<int(PsychicRequest* request, JsonVariantConst params, JsonVariant& result)> PsychicJsonRpcCallback;
 #ifdef ARDUINO
 typedef std::function<esp_err_t(PsychicRequest* request, const String& filename, uint64_t index, uint8_t* data, size_t len, bool final)> PsychicUploadCallback;
 #else
@@ -0,0 +1,320 @@
+#include "PsychicDeflate.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define DEFLATE_MIN_MATCH     3
+#define DEFLATE_MAX_MATCH     258
+#define DEFLATE_MIN_LOOKAHEAD (DEFLATE_MAX_MATCH + DEFLATE_MIN_MATCH + 1)
+// a 3 byte match further back than this costs more bits than three literals
+#define DEFLATE_TOO_FAR 4096
+
+static const uint16_t lengthBase[29] = {3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258};
+static const uint8_t lengthExtra[29] = {0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0};
+static const uint16_t distBase[30] = {1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577};
+static const uint8_t distExtra[30] = {0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13};
+
+// half-byte CRC-32 table, 64 bytes instead of the usual 1kb
+static const uint32_t crcTable[16] = {
+  0x00000000, 0x1DB71064, 0x3B6E20C8, 0x26D930AC, 0x76DC4190, 0x6B6B51F4, 0x4DB26158, 0x5005713C,
+  0xEDB88320, 0xF00F9344, 0xD6D6A3E8, 0xCB61B38C, 0x9B64C2B0, 0x86D3D2D4, 0xA00AE278, 0xBDBDF21C};
+
+static uint32_t crc32Update(uint32_t crc, const uint8_t* data, size_t len)
+{
+  crc = ~crc;
+  while (len--) {
+    crc ^= *data++;
+    crc = (crc >> 4) ^ crcTable[crc & 0x0F];
+    crc = (crc >> 4) ^ crcTable[crc & 0x0F];
+  }
+  return ~crc;
+}
+
+// multiplicative hash of the next three bytes
+static inline uint32_t hash3(const uint8_t* p, size_t bits)
+{
+  return ((uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16) * 2654435761u >> (32 - bits);
+}
+
+static int clampWindowBits(int windowBits)
+{
+  // the window has to hold a full lookahead, and distances stop at 32k
+  return windowBits < 9 ? 9 : windowBits > 15 ? 15 : windowBits;
+}
+
+static int clampMemLevel(int memLevel)
+{
+  return memLevel < 1 ? 1 : memLevel > 9 ? 9 : memLevel;
+}
+
+PsychicDeflate::PsychicDeflate(int windowBits, int memLevel) : _windowBits(clampWindowBits(windowBits)),
+                                                              _memLevel(clampMemLevel(memLevel)),
+                                                              _memory(NULL),
+                                                              _window(NULL),
+                                                              _head(NULL),
+                                                              _prev(NULL),
+                                                              _out(NULL),
+                                                              _fill(0),
+                                                              _pos(0),
+                                                              _outPos(0),
+                                                              _bits(0),
+                                                              _bitCount(0),
+                                                              _crc(0),
+                                                              _totalIn(0),
+                                                              _totalOut(0),
+                                                              _err(0)
+{
+  _windowSize = (size_t)1 << _windowBits;
+  _hashBits = _memLevel + 7;
+  _maxChain = (size_t)4 << (_memLevel >> 1);
+}
+
+PsychicDeflate::~PsychicDeflate()
+{
+  free(_memory);
+}
+
+size_t PsychicDeflate::memoryUsage(int windowBits, int memLevel)
+{
+  size_t windowSize = (size_t)1 << clampWindowBits(windowBits);
+  size_t hashSize = (size_t)1 << (clampMemLevel(memLevel) + 7);
+
+  return 2 * windowSize + windowSize * sizeof(uint16_t) + hashSize * sizeof(uint16_t) + PSYCHIC_GZIP_OUT_SIZE;
+}
+
+bool PsychicDeflate::begin(PsychicDeflateSink sink)
+{
+  if (_memory)
+    return true;
+
+  // one allocation for everything, 16 bit arrays first to keep them aligned
+  size_t hashSize = (size_t)1 << _hashBits;
+  _memory = (uint8_t*)malloc(memoryUsage(_windowBits, _memLevel));
+  if (!_memory)
+    return false;
+
+  _head = (uint16_t*)_memory;
+  _prev = _head + hashSize;
+  _window = (uint8_t*)(_prev + _windowSize);
+  _out = _window + 2 * _windowSize;
+  memset(_head, 0, hashSize * sizeof(uint16_t));
+  memset(_prev, 0, _windowSize * sizeof(uint16_t));
+
+  _sink = sink;
+
+  // gzip member header: deflate, no flags, no mtime, unknown OS
+  static const uint8_t header[10] = {0x1f, 0x8b, 8, 0, 0, 0, 0, 0, 0, 0xff};
+  for (uint8_t b : header)
+    _putByte(b);
+
+  // everything goes into one fixed Huffman block, finish() closes it
+  _putBits(0, 1);
+  _putBits(1, 2);
+
+  return true;
+}
+
+int PsychicDeflate::write(const uint8_t* data, size_t len)
+{
+  if (!_memory)
+    return -1;
+
+  _crc = crc32Update(_crc, data, len);
+  _totalIn += len;
+
+  while (len && !_err) {
+    if (_fill == 2 * _windowSize)
+      _slide();
+
+    size_t n = 2 * _windowSize - _fill;
+    if (n > len)
+      n = len;
+    memcpy(_window + _fill, data, n);
+    _fill += n;
+    data += n;
+    len -= n;
+
+    _compress(false);
+  }
+
+  return _err;
+}
+
+int PsychicDeflate::finish()
+{
+  if (!_memory)
+    return -1;
+
+  _compress(true);
+
+  // end of block, then an empty final block so we never had to know up front which one was last
+  _putCode(0, 7);
+  _putBits(1, 1);
+  _putBits(1, 2);
+  _putCode(0, 7);
+  _alignBits();
+
+  for (int i = 0; i < 4; i++)
+    _putByte(_crc >> (8 * i));
+  for (int i = 0; i < 4; i++)
+    _putByte((uint32_t)_totalIn >> (8 * i));
+
+  _flushOut();
+
+  free(_memory);
+  _memory = NULL;
+
+  return _err;
+}
+
+void PsychicDeflate::_compress(bool finish)
+{
+  size_t mask = _windowSize - 1;
+
+  while (_pos < _fill && !_err) {
+    size_t lookahead = _fill - _pos;
+
+    // keep enough bytes ahead to find a full length match, unless there is no more input coming
+    if (!finish && lookahead < DEFLATE_MIN_LOOKAHEAD)
+      break;
+
+    size_t bestLen = 0;
+    size_t bestDist = 0;
+
+    if (lookahead >= DEFLATE_MIN_MATCH) {
+      const uint8_t* scan = _window + _pos;
+      size_t maxLen = lookahead < DEFLATE_MAX_MATCH ? lookahead : DEFLATE_MAX_MATCH;
+
+      uint32_t hash = hash3(scan, _hashBits);
+      size_t cur = _head[hash];
+      _prev[_pos & mask] = cur;
+      _head[hash] = _pos;
+
+      // walk the chain newest first; stale entries are harmless as every candidate is compared byte for byte
+      for (size_t chain = _maxChain; chain && cur < _pos && _pos - cur < _windowSize; chain--) {
+        const uint8_t* match = _window + cur;
+        if (match[bestLen] == scan[bestLen] && match[0] == scan[0]) {
+          size_t len = 0;
+          while (len < maxLen && match[len] == scan[len])
+            len++;
+
+          if (len > bestLen) {
+            bestLen = len;
+            bestDist = _pos - cur;
+            if (len == maxLen)
+              break;
+          }
+        }
+
+        size_t next = _prev[cur & mask];
+        if (next >= cur)
+          break;
+        cur = next;
+      }
+
+      if (bestLen == DEFLATE_MIN_MATCH && bestDist > DEFLATE_TOO_FAR)
+        bestLen = 0;
+    }
+
+    if (bestLen >= DEFLATE_MIN_MATCH) {
+      _putMatch(bestLen, bestDist);
+
+      // index the positions inside the match too, so later data can refer back into it
+      for (size_t i = 1; i < bestLen && _pos + i + DEFLATE_MIN_MATCH <= _fill; i++) {
+        uint32_t hash = hash3(_window + _pos + i, _hashBits);
+        _prev[(_pos + i) & mask] = _head[hash];
+        _head[hash] = _pos + i;
+      }
+      _pos += bestLen;
+    } else {
+      _putLiteral(_window[_pos]);
+      _pos++;
+    }
+  }
+}
+
+// drop the older half of the window to make room for more input
+void PsychicDeflate::_slide()
+{
+  memmove(_window, _window + _windowSize, _windowSize);
+  _fill -= _windowSize;
+  _pos -= _windowSize;
+
+  size_t hashSize = (size_t)1 << _hashBits;
+  for (size_t i = 0; i < hashSize; i++)
+    _head[i] = _head[i] >= _windowSize ? _head[i] - _windowSize : 0;
+  for (size_t i = 0; i < _windowSize; i++)
+    _prev[i] = _prev[i] >= _windowSize ? _prev[i] - _windowSize : 0;
+}
+
+void PsychicDeflate::_putBits(uint32_t value, uint8_t count)
+{
+  _bits |= value << _bitCount;
+  _bitCount += count;
+  while (_bitCount >= 8) {
+    _putByte(_bits & 0xFF);
+    _bits >>= 8;
+    _bitCount -= 8;
+  }
+}
+
+// Huffman codes are packed starting from their most significant bit
+void PsychicDeflate::_putCode(uint16_t code, uint8_t length)
+{
+  uint16_t reversed = 0;
+  for (uint8_t i = 0; i < length; i++) {
+    reversed = (reversed << 1) | (code & 1);
+    code >>= 1;
+  }
+  _putBits(reversed, length);
+}
+
+// fixed literal/length code from RFC 1951 section 3.2.6
+void PsychicDeflate::_putLiteral(uint16_t symbol)
+{
+  if (symbol < 144)
+    _putCode(0x30 + symbol, 8);
+  else if (symbol < 256)
+    _putCode(0x190 + symbol - 144, 9);
+  else if (symbol < 280)
+    _putCode(symbol - 256, 7);
+  else
+    _putCode(0xC0 + symbol - 280, 8);
+}
+
+void PsychicDeflate::_putMatch(size_t length, size_t distance)
+{
+  int code = 28;
+  while (lengthBase[code] > length)
+    code--;
+  _putLiteral(257 + code);
+  if (lengthExtra[code])
+    _putBits(length - lengthBase[code], lengthExtra[code]);
+
+  code = 29;
+  while (distBase[code] > distance)
+    code--;
+  _putCode(code, 5);
+  if (distExtra[code])
+    _putBits(distance - distBase[code], distExtra[code]);
+}
+
+void PsychicDeflate::_putByte(uint8_t b)
+{
+  _out[_outPos++] = b;
+  if (_outPos == PSYCHIC_GZIP_OUT_SIZE)
+    _flushOut();
+}
+
+void PsychicDeflate::_alignBits()
+{
+  if (_bitCount)
+    _putBits(0, 8 - _bitCount);
+}
+
+void PsychicDeflate::_flushOut()
+{
+  if (_outPos && !_err)
+    _err = _sink(_out, _outPos);
+  _totalOut += _outPos;
+  _outPos = 0;
+}
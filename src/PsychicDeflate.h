@@ -0,0 +1,90 @@
+#ifndef PsychicDeflate_h
+#define PsychicDeflate_h
+
+#include <functional>
+#include <stddef.h>
+#include <stdint.h>
+
+// log2 of the LZ77 window (9..15). RAM is roughly 4 << windowBits bytes.
+#ifndef PSYCHIC_GZIP_WINDOW_BITS
+  #define PSYCHIC_GZIP_WINDOW_BITS 11
+#endif
+
+// 1..9, like zlib: sizes the hash table (256 << memLevel bytes) and how far each match search walks.
+#ifndef PSYCHIC_GZIP_MEM_LEVEL
+  #define PSYCHIC_GZIP_MEM_LEVEL 3
+#endif
+
+// compressed bytes are collected in a buffer this big before they are handed to the sink
+#ifndef PSYCHIC_GZIP_OUT_SIZE
+  #define PSYCHIC_GZIP_OUT_SIZE 1024
+#endif
+
+// bodies of a known length smaller than this are not worth compressing
+#ifndef PSYCHIC_GZIP_THRESHOLD
+  #define PSYCHIC_GZIP_THRESHOLD 1024
+#endif
+
+// receives compressed output, returns 0 (ESP_OK) on success
+typedef std::function<int(const uint8_t* data, size_t len)> PsychicDeflateSink;
+
+// Small streaming gzip encoder: LZ77 with hash chains and fixed Huffman codes.
+// Trades some ratio against zlib for a few KB of RAM and no dependencies, and
+// builds on the host as well so it can be benchmarked there.
+class PsychicDeflate
+{
+  private:
+    PsychicDeflateSink _sink;
+    int _windowBits;
+    int _memLevel;
+
+    uint8_t* _memory;
+    uint8_t* _window;
+    uint16_t* _head;
+    uint16_t* _prev;
+    uint8_t* _out;
+
+    size_t _windowSize;
+    size_t _hashBits;
+    size_t _maxChain;
+    size_t _fill;
+    size_t _pos;
+    size_t _outPos;
+
+    uint32_t _bits;
+    uint8_t _bitCount;
+
+    uint32_t _crc;
+    size_t _totalIn;
+    size_t _totalOut;
+    int _err;
+
+    void _compress(bool finish);
+    void _slide();
+    void _putBits(uint32_t value, uint8_t count);
+    void _putCode(uint16_t code, uint8_t length);
+    void _putLiteral(uint16_t symbol);
+    void _putMatch(size_t length, size_t distance);
+    void _putByte(uint8_t b);
+    void _alignBits();
+    void _flushOut();
+
+  public:
+    PsychicDeflate(int windowBits = PSYCHIC_GZIP_WINDOW_BITS, int memLevel = PSYCHIC_GZIP_MEM_LEVEL);
+    ~PsychicDeflate();
+
+    // allocates the working memory and writes the gzip header. false if out of memory.
+    bool begin(PsychicDeflateSink sink);
+
+    // returns 0 or the first error the sink reported
+    int write(const uint8_t* data, size_t len);
+    int finish();
+
+    size_t totalIn() { return _totalIn; }
+    size_t totalOut() { return _totalOut; }
+
+    // bytes begin() will allocate for the given settings
+    static size_t memoryUsage(int windowBits = PSYCHIC_GZIP_WINDOW_BITS, int memLevel = PSYCHIC_GZIP_MEM_LEVEL);
+};
+
+#endif // PsychicDeflate_h
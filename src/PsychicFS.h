@@ -5,10 +5,10 @@
 //   — Arduino fs::FS / fs::File   (ARDUINO builds, zero-overhead delegation)
 //   — POSIX fopen/fstat/fread     (native ESP-IDF builds)
 //
-// The interface covers exactly the 8 operations used by PsychicHttp:
+// The interface covers exactly the 10 operations used by PsychicHttp:
 //   FS::open(), FS::exists()
-//   File::operator bool(), File::isDirectory(), File::size(),
-//   File::name(), File::readBytes(), File::close()
+//   File::operator bool(), File::isDirectory(), File::size(), File::getLastWrite(),
+//   File::name(), File::readBytes(), File::seek(), File::close()
 //
 // On Arduino, psychic::File's operator bool() returns
 //   (bool)fs::File && !isDirectory()
@@ -36,8 +36,12 @@ namespace psychic
       explicit operator bool() const { return (bool)_f && !_f.isDirectory(); }
       bool isDirectory() const { return _f.isDirectory(); }
       size_t size() const { return _f.size(); }
+      time_t getLastWrite() const { return _f.getLastWrite(); }
       const char* name() const { return _f.name(); }
       size_t readBytes(char* buf, size_t len) { return _f.readBytes(buf, len); }
+      bool seek(size_t pos) { return _f.seek(pos, fs::SeekSet); }
+      // Arduino's FS hides the descriptor, so PsychicResponse::sendFile() never applies
+      int fd() const { return -1; }
       void close() { _f.close(); }
   };
 
@@ -80,24 +84,26 @@ namespace psychic
   {
       FILE* _fp = nullptr;
       size_t _size = 0;
+      time_t _mtime = 0;
       std::string _path;
 
     public:
       File() = default;
-      File(FILE* fp, size_t size, const char* path) : _fp(fp), _size(size), _path(path ? path : "") {}
+      File(FILE* fp, size_t size, const char* path, time_t mtime = 0) : _fp(fp), _size(size), _mtime(mtime), _path(path ? path : "") {}
 
       // non-copyable — owns the FILE*
       File(const File&) = delete;
       File& operator=(const File&) = delete;
 
       // moveable
-      File(File&& o) noexcept : _fp(o._fp), _size(o._size), _path(std::move(o._path)) { o._fp = nullptr; }
+      File(File&& o) noexcept : _fp(o._fp), _size(o._size), _mtime(o._mtime), _path(std::move(o._path)) { o._fp = nullptr; }
       File& operator=(File&& o) noexcept
       {
         if (this != &o) {
           close();
           _fp = o._fp;
           _size = o._size;
+          _mtime = o._mtime;
           _path = std::move(o._path);
           o._fp = nullptr;
         }
@@ -111,8 +117,12 @@ namespace psychic
       // FS::open() returns an empty File{} for directories, so this is always false
       bool isDirectory() const { return false; }
       size_t size() const { return _size; }
+      time_t getLastWrite() const { return _mtime; }
       const char* name() const { return _path.c_str(); }
       size_t readBytes(char* buf, size_t len) { return _fp ? fread(buf, 1, len, _fp) : 0; }
+      bool seek(size_t pos) { return _fp && fseek(_fp, pos, SEEK_SET) == 0; }
+      // the descriptor under the FILE*, for PsychicResponse::sendFile(). -1 if closed.
+      int fd() const { return _fp ? fileno(_fp) : -1; }
       void close()
       {
         if (_fp) {
@@ -135,7 +145,7 @@ namespace psychic
         if (S_ISDIR(st.st_mode))
           return File{}; // directories → empty (false) File
         FILE* fp = fopen(path, mode);
-        return fp ? File{fp, (size_t)st.st_size, path} : File{};
+        return fp ? File{fp, (size_t)st.st_size, path, st.st_mtime} : File{};
       }
 
       bool exists(const char* path)
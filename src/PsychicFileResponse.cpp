@@ -1,4 +1,5 @@
 #include "PsychicFileResponse.h"
+#include "PsychicHttpServer.h"
 #include "PsychicRequest.h"
 #include "PsychicResponse.h"
 #include <http_status.h>
@@ -20,6 +21,12 @@ void PsychicFileResponse::_initFromFS(psychic::FS fs, const char* path, const ch
   }
 
   _content = fs.open(spath.c_str(), "r");
+  _initFromFile(path, contentType, download);
+}
+
+// Everything that only depends on the (plain) path, once _content is open.
+void PsychicFileResponse::_initFromFile(const char* path, const char* contentType, bool download)
+{
   setContentLength(_content.size());
 
   if (!contentType || !*contentType)
@@ -51,6 +58,15 @@ PsychicFileResponse::PsychicFileResponse(PsychicResponse* response, psychic::FS
   _initFromFS(fs, path, contentType, download);
 }
 
+// Used by PsychicStaticFileHandler to serve the handle it probed with, without opening it again
+PsychicFileResponse::PsychicFileResponse(PsychicResponse* response, psychic::File&& content, const char* path, const char* contentType, bool download, const char* encoding)
+    : PsychicResponseDelegate(response), _content(std::move(content))
+{
+  if (encoding)
+    addHeader("Content-Encoding", encoding);
+  _initFromFile(path, contentType, download);
+}
+
 #ifdef ARDUINO
 // PUBLIC API for Arduino - replaces old ctor(FS&, String).
 PsychicFileResponse::PsychicFileResponse(PsychicResponse* response, fs::FS& fs, const String& path, const String& contentType, bool download)
@@ -90,104 +106,191 @@ PsychicFileResponse::~PsychicFileResponse()
     _content.close();
 }
 
-void PsychicFileResponse::_setContentTypeFromPath(const char* p)
+const char* PsychicFileResponse::contentTypeFor(const char* p)
 {
-  const char* _contentType;
-
   if (endsWith(p, ".html"))
-    _contentType = "text/html";
+    return "text/html";
   else if (endsWith(p, ".htm"))
-    _contentType = "text/html";
+    return "text/html";
   else if (endsWith(p, ".css"))
-    _contentType = "text/css";
+    return "text/css";
   else if (endsWith(p, ".json"))
-    _contentType = "application/json";
+    return "application/json";
   else if (endsWith(p, ".js"))
-    _contentType = "application/javascript";
+    return "application/javascript";
   else if (endsWith(p, ".png"))
-    _contentType = "image/png";
+    return "image/png";
   else if (endsWith(p, ".gif"))
-    _contentType = "image/gif";
+    return "image/gif";
   else if (endsWith(p, ".jpg"))
-    _contentType = "image/jpeg";
+    return "image/jpeg";
   else if (endsWith(p, ".ico"))
-    _contentType = "image/x-icon";
+    return "image/x-icon";
   else if (endsWith(p, ".svg"))
-    _contentType = "image/svg+xml";
+    return "image/svg+xml";
   else if (endsWith(p, ".eot"))
-    _contentType = "font/eot";
+    return "font/eot";
   else if (endsWith(p, ".woff"))
-    _contentType = "font/woff";
+    return "font/woff";
   else if (endsWith(p, ".woff2"))
-    _contentType = "font/woff2";
+    return "font/woff2";
   else if (endsWith(p, ".ttf"))
-    _contentType = "font/ttf";
+    return "font/ttf";
   else if (endsWith(p, ".xml"))
-    _contentType = "text/xml";
+    return "text/xml";
   else if (endsWith(p, ".pdf"))
-    _contentType = "application/pdf";
+    return "application/pdf";
   else if (endsWith(p, ".zip"))
-    _contentType = "application/zip";
+    return "application/zip";
   else if (endsWith(p, ".gz"))
-    _contentType = "application/x-gzip";
+    return "application/x-gzip";
   else
-    _contentType = "text/plain";
+    return "text/plain";
+}
 
-  setContentType(_contentType);
+void PsychicFileResponse::_setContentTypeFromPath(const char* p)
+{
+  setContentType(contentTypeFor(p));
 }
 
-esp_err_t PsychicFileResponse::send()
+// Looks at Range and If-Range: 1 to send bytes [start, end], 0 to send the whole file, -1 if unsatisfiable.
+// Only a single byte range is supported, anything fancier gets the whole file (which the RFC allows).
+int PsychicFileResponse::_parseRange(size_t size, size_t& start, size_t& end)
 {
-  esp_err_t err = ESP_OK;
+  PsychicRequest* request = getRequest();
+  if (!request->hasHeader("Range"))
+    return 0;
 
-  // just send small files directly
-  size_t size = getContentLength();
-  if (size < FILE_CHUNK_SIZE) {
-    uint8_t* buffer = (uint8_t*)malloc(size);
-    if (buffer == NULL && size > 0) {
-      ESP_LOGE(PH_TAG, "Unable to allocate %zu bytes to send chunk", size);
-      httpd_resp_send_err(request(), HTTPD_500_INTERNAL_SERVER_ERROR, "Unable to allocate memory.");
-      return ESP_FAIL;
-    }
+  // If-Range: the client only wants the part if its copy is still current
+  if (request->hasHeader("If-Range")) {
+    std::string validator = request->headerCStr("If-Range");
+    const char* etag = _findHeader("ETag");
+    const char* modified = _findHeader("Last-Modified");
+    if (!(etag && validator == etag) && !(modified && validator == modified))
+      return 0;
+  }
 
-    size_t readSize = _content.readBytes((char*)buffer, size);
+  std::string range = request->headerCStr("Range");
+  if (range.compare(0, 6, "bytes=") != 0 || range.find(',') != std::string::npos)
+    return 0;
 
-    setContent(buffer, readSize);
-    err = _response->send();
+  const char* spec = range.c_str() + 6;
+  const char* dash = strchr(spec, '-');
+  if (!dash || !(dash == spec || isdigit((unsigned char)*spec)) || (dash[1] && !isdigit((unsigned char)dash[1])))
+    return 0;
 
-    free(buffer);
+  char* stop;
+  if (dash == spec) {
+    // "bytes=-500" is the last 500 bytes
+    size_t suffix = strtoul(dash + 1, &stop, 10);
+    if (stop == dash + 1 || *stop)
+      return 0;
+    if (!suffix || !size)
+      return -1;
+    start = suffix < size ? size - suffix : 0;
+    end = size - 1;
   } else {
-    /* Retrieve the pointer to scratch buffer for temporary storage */
-    char* chunk = (char*)malloc(FILE_CHUNK_SIZE);
-    if (chunk == NULL) {
-      ESP_LOGE(PH_TAG, "Unable to allocate %zu bytes to send chunk", (size_t)FILE_CHUNK_SIZE);
-      httpd_resp_send_err(request(), HTTPD_500_INTERNAL_SERVER_ERROR, "Unable to allocate memory.");
-      return ESP_FAIL;
+    // "bytes=500-999" or "bytes=500-"
+    start = strtoul(spec, &stop, 10);
+    if (stop != dash)
+      return 0;
+    end = size - 1;
+    if (dash[1]) {
+      end = strtoul(dash + 1, &stop, 10);
+      if (stop == dash + 1 || *stop || end < start)
+        return 0;
     }
+    if (start >= size)
+      return -1;
+    if (end >= size)
+      end = size - 1;
+  }
+
+  return 1;
+}
+
+const char* PsychicFileResponse::_findHeader(const char* field)
+{
+  for (auto& header : _response->headers())
+    if (strcasecmp(header.field.c_str(), field) == 0)
+      return header.value.c_str();
+  return nullptr;
+}
+
+esp_err_t PsychicFileResponse::send()
+{
+  esp_err_t err = ESP_OK;
+  size_t size = getContentLength();
+
+  // big files go from the file straight to the socket where the transport allows it
+  bool direct = size > FILE_CHUNK_SIZE && canSendFile(_content.fd());
+  size_t offset = 0;
+
+  // otherwise a transfer buffer from the server's pool: the whole file if it fits, else whatever is free
+  PsychicPooledBuffer buffer(&getRequest()->server()->bufferPool);
+  if (!direct && !buffer.acquire(std::min(size, (size_t)PSYCHIC_POOL_SMALL_SIZE), std::min(size, (size_t)FILE_CHUNK_SIZE))) {
+    ESP_LOGE(PH_TAG, "No buffer to send %zu bytes", size);
+    addHeader("Retry-After", "1");
+    return _response->send(503);
+  }
+
+  // byte ranges, on plain 200 responses only. for a .gz/.br variant the range counts the
+  // encoded bytes, same as the Content-Length of the full response would.
+  if (getCode() == 200) {
+    addHeader("Accept-Ranges", "bytes");
 
-    // now the headers
-    sendHeaders();
-
-    size_t chunksize;
-    do {
-      /* Read file in chunks into the scratch buffer */
-      chunksize = _content.readBytes(chunk, FILE_CHUNK_SIZE);
-      if (chunksize > 0) {
-        err = sendChunk((uint8_t*)chunk, chunksize);
-        if (err != ESP_OK)
-          break;
+    size_t start, end;
+    int range = _parseRange(size, start, end);
+    char contentRange[64];
+    if (range < 0) {
+      snprintf(contentRange, sizeof(contentRange), "bytes */%zu", size);
+      addHeader("Content-Range", contentRange);
+      return _response->send(416);
+    } else if (range > 0) {
+      if (!_content.seek(start)) {
+        ESP_LOGE(PH_TAG, "Unable to seek to byte %zu for a range request", start);
+        return _response->send(500);
       }
+      snprintf(contentRange, sizeof(contentRange), "bytes %zu-%zu/%zu", start, end, size);
+      addHeader("Content-Range", contentRange);
+      setCode(206);
+      size = end - start + 1;
+      offset = start;
+      setContentLength(size);
+    }
+  }
 
-      /* Keep looping till the whole file is sent */
-    } while (chunksize != 0);
+  if (direct) {
+    err = sendHeaders(size);
+    if (err == ESP_OK)
+      err = sendFile(_content.fd(), offset, size);
+    return err;
+  }
 
-    // keep track of our memory
-    free(chunk);
+  // just send small files directly
+  if (size <= buffer.size()) {
+    size_t readSize = _content.readBytes((char*)buffer.data(), size);
 
-    if (err == ESP_OK) {
-      ESP_LOGD(PH_TAG, "File sending complete");
-      finishChunking();
+    setContent(buffer.data(), readSize);
+    err = _response->send();
+  } else {
+    // the size is known, so the slices go out raw behind a Content-Length instead of chunked
+    err = sendHeaders(size);
+
+    while (err == ESP_OK && size) {
+      size_t readSize = _content.readBytes((char*)buffer.data(), std::min(size, buffer.size()));
+      if (!readSize) {
+        // failing the handler drops the connection, so the client can tell the body is cut short
+        ESP_LOGE(PH_TAG, "File ended %zu bytes early", size);
+        err = ESP_FAIL;
+        break;
+      }
+      err = sendData(buffer.data(), readSize);
+      size -= readSize;
     }
+
+    if (err == ESP_OK)
+      ESP_LOGD(PH_TAG, "File sending complete");
   }
 
   return err;
@@ -12,6 +12,9 @@ class PsychicFileResponse : public PsychicResponseDelegate
   private:
     void _setContentTypeFromPath(const char* path);
     void _initFromFS(psychic::FS fs, const char* path, const char* contentType, bool download);
+    void _initFromFile(const char* path, const char* contentType, bool download);
+    int _parseRange(size_t size, size_t& start, size_t& end);
+    const char* _findHeader(const char* field);
 
   protected:
     psychic::File _content;
@@ -21,6 +24,10 @@ class PsychicFileResponse : public PsychicResponseDelegate
       const char* contentType = nullptr, bool download = false);
     PsychicFileResponse(PsychicResponse* response, psychic::FS fs, const char* path,
       const char* contentType = nullptr, bool download = false);
+    // take over a file that is already open. path names the plain file (for the Content-Type
+    // and Content-Disposition) and encoding is the Content-Encoding of what content holds, if any.
+    PsychicFileResponse(PsychicResponse* response, psychic::File&& content, const char* path,
+      const char* contentType = nullptr, bool download = false, const char* encoding = nullptr);
 
 #ifdef ARDUINO
     PsychicFileResponse(PsychicResponse* response, fs::FS& fs, const String& path,
@@ -31,6 +38,9 @@ class PsychicFileResponse : public PsychicResponseDelegate
 
     ~PsychicFileResponse();
     esp_err_t send();
+
+    // Content-Type by file extension, text/plain if unknown
+    static const char* contentTypeFor(const char* path);
 };
 
 #endif // PsychicFileResponse_h
\ No newline at end of file
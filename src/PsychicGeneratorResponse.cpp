@@ -0,0 +1,168 @@
+#include "PsychicGeneratorResponse.h"
+#include "PsychicHttpServer.h"
+#include "PsychicRequest.h"
+
+// handing the rest of the body to the server's work queue needs httpd_req_async_handler_begin() from esp-idf
+// itself; the async_worker backport doesn't release the socket back to the server loop.
+#if ESP_IDF_VERSION >= ESP_IDF_VERSION_VAL(5, 1, 0)
+  #define GENERATOR_CAN_DETACH
+#endif
+
+#ifdef GENERATOR_CAN_DETACH
+namespace
+{
+  bool onAsyncWorker()
+  {
+#ifdef ENABLE_ASYNC
+    return is_on_async_worker_thread();
+#else
+    return false;
+#endif
+  }
+
+  // state for a body that continues after the handler returned. owns the pool buffer and the request copy.
+  struct GeneratorJob {
+      httpd_req_t* req;
+      PsychicGeneratorCallback generator;
+      PsychicBufferPool* pool;
+      uint8_t* buffer;
+      size_t size;
+      size_t offset;
+      size_t length;
+  };
+
+  void generatorFinish(GeneratorJob* job, esp_err_t err)
+  {
+    if (err == ESP_OK && job->length == PsychicGeneratorResponse::UNKNOWN_LENGTH)
+      err = httpd_resp_send_chunk(job->req, NULL, 0);
+
+    httpd_handle_t server = job->req->handle;
+    int sockfd = httpd_req_to_sockfd(job->req);
+
+    httpd_req_async_handler_complete(job->req);
+    job->pool->release(job->buffer);
+    delete job;
+
+    // a truncated body is indistinguishable from a complete one unless we hang up
+    if (err != ESP_OK)
+      httpd_sess_trigger_close(server, sockfd);
+  }
+
+  void generatorStep(void* arg)
+  {
+    GeneratorJob* job = (GeneratorJob*)arg;
+    bool chunked = job->length == PsychicGeneratorResponse::UNKNOWN_LENGTH;
+
+    size_t want = chunked ? job->size : std::min(job->size, job->length - job->offset);
+    if (!want)
+      return generatorFinish(job, ESP_OK);
+
+    size_t len = std::min(job->generator(job->buffer, want, job->offset), want);
+    if (!len) {
+      if (!chunked)
+        ESP_LOGE(PH_TAG, "Generator ended at %zu of %zu bytes", job->offset, job->length);
+      return generatorFinish(job, chunked ? ESP_OK : ESP_FAIL);
+    }
+
+    esp_err_t err = chunked ? httpd_resp_send_chunk(job->req, (const char*)job->buffer, len) : PsychicResponse::sendRaw(job->req, job->buffer, len);
+    if (err != ESP_OK) {
+      ESP_LOGE(PH_TAG, "Generator send failed (%s)", esp_err_to_name(err));
+      return generatorFinish(job, err);
+    }
+    job->offset += len;
+
+    // requeue ourselves so every other socket gets a turn before the next slice
+    if (httpd_queue_work(job->req->handle, generatorStep, job) != ESP_OK)
+      generatorFinish(job, ESP_FAIL);
+  }
+} // namespace
+#endif
+
+#ifdef ARDUINO
+PsychicGeneratorResponse::PsychicGeneratorResponse(PsychicResponse* response, const String& contentType, PsychicGeneratorCallback generator, size_t length)
+    : PsychicResponseDelegate(response), _generator(generator), _length(length), _yield(false)
+{
+  setContentType(contentType.c_str());
+}
+#else
+PsychicGeneratorResponse::PsychicGeneratorResponse(PsychicResponse* response, const char* contentType, PsychicGeneratorCallback generator, size_t length)
+    : PsychicResponseDelegate(response), _generator(generator), _length(length), _yield(false)
+{
+  setContentType(contentType);
+}
+#endif
+
+PsychicGeneratorResponse* PsychicGeneratorResponse::setYield(bool yield)
+{
+  _yield = yield;
+  return this;
+}
+
+esp_err_t PsychicGeneratorResponse::send()
+{
+  if (!_generator)
+    return ESP_ERR_INVALID_STATE;
+
+  // slices are as big as the buffer the pool can spare
+  PsychicBufferPool* pool = &getRequest()->server()->bufferPool;
+  size_t size;
+  uint8_t* buffer = pool->acquire(PSYCHIC_POOL_SMALL_SIZE, FILE_CHUNK_SIZE, size);
+  if (buffer == NULL) {
+    addHeader("Retry-After", "1");
+    return _response->send(503);
+  }
+
+  // a known length goes out with Content-Length, otherwise we fall back to chunked encoding
+  bool chunked = _length == UNKNOWN_LENGTH;
+  esp_err_t err = ESP_OK;
+  if (chunked)
+    sendHeaders();
+  else
+    err = sendHeaders(_length);
+
+  size_t offset = 0;
+  while (err == ESP_OK) {
+    size_t want = chunked ? size : std::min(size, _length - offset);
+    if (!want)
+      break;
+
+    size_t len = std::min(_generator(buffer, want, offset), want);
+    if (!len) {
+      if (!chunked) {
+        ESP_LOGE(PH_TAG, "Generator ended at %zu of %zu bytes", offset, _length);
+        err = ESP_FAIL;
+      }
+      break;
+    }
+
+    err = chunked ? sendChunk(buffer, len) : sendData(buffer, len);
+    offset += len;
+
+    if (err != ESP_OK || !_yield)
+      continue;
+
+#ifdef GENERATOR_CAN_DETACH
+    // the headers are out now, so the rest can be sent from the work queue without touching this response.
+    // a gzipped body has to keep going through the response's compressor, so that one stays inline.
+    // on an async worker the request is already a copy that the worker completes when we return,
+    // so the body has to finish here.
+    httpd_req_t* async = NULL;
+    if (!_response->isCompressing() && !onAsyncWorker() && httpd_req_async_handler_begin(request(), &async) == ESP_OK) {
+      GeneratorJob* job = new GeneratorJob{async, _generator, pool, buffer, size, offset, _length};
+      if (httpd_queue_work(async->handle, generatorStep, job) == ESP_OK)
+        return ESP_OK;
+
+      // couldn't queue it, carry on inline
+      httpd_req_async_handler_complete(async);
+      delete job;
+    }
+#endif
+    taskYIELD();
+  }
+
+  if (chunked && err == ESP_OK)
+    err = finishChunking();
+
+  pool->release(buffer);
+  return err;
+}
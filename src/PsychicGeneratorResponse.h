@@ -0,0 +1,36 @@
+#ifndef PsychicGeneratorResponse_h
+#define PsychicGeneratorResponse_h
+
+#include "PsychicCore.h"
+#include "PsychicResponse.h"
+
+// Fill buffer with up to maxLen bytes of body starting at offset and return how many were written.
+// Returning 0 ends the body.
+typedef std::function<size_t(uint8_t* buffer, size_t maxLen, size_t offset)> PsychicGeneratorCallback;
+
+// Pull-model response: the server asks the generator for the next slice only when it is ready to send it,
+// so a large body never has to exist in memory at once. Anything the generator captures must stay valid
+// until the transfer ends, which with setYield(true) can be after the handler has returned.
+class PsychicGeneratorResponse : public PsychicResponseDelegate
+{
+  protected:
+    PsychicGeneratorCallback _generator;
+    size_t _length;
+    bool _yield;
+
+  public:
+    static const size_t UNKNOWN_LENGTH = SIZE_MAX;
+
+#ifdef ARDUINO
+    PsychicGeneratorResponse(PsychicResponse* response, const String& contentType, PsychicGeneratorCallback generator, size_t length = UNKNOWN_LENGTH);
+#else
+    PsychicGeneratorResponse(PsychicResponse* response, const char* contentType, PsychicGeneratorCallback generator, size_t length = UNKNOWN_LENGTH);
+#endif
+
+    // hand the server back between slices so other sockets get serviced during long transfers
+    PsychicGeneratorResponse* setYield(bool yield);
+
+    esp_err_t send();
+};
+
+#endif // PsychicGeneratorResponse_h
@@ -3,9 +3,12 @@
 
 // #define ENABLE_ASYNC // This is something added in ESP-IDF 5.1.x where each request can be handled in its own thread
 
+#include "PsychicAssetHandler.h"
+#include "PsychicBundleHandler.h"
 #include "PsychicEndpoint.h"
 #include "PsychicEventSource.h"
 #include "PsychicFileResponse.h"
+#include "PsychicGeneratorResponse.h"
 #include "PsychicHandler.h"
 #include "PsychicHttpServer.h"
 #include "PsychicJson.h"
@@ -16,6 +19,7 @@
 #include "PsychicResponse.h"
 #include "PsychicStaticFileHandler.h"
 #include "PsychicStreamResponse.h"
+#include "PsychicTemplate.h"
 #include "PsychicUploadHandler.h"
 #include "PsychicVersion.h"
 #include "PsychicWebSocket.h"
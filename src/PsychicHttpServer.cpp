@@ -122,6 +122,9 @@ esp_err_t PsychicHttpServer::start()
   start_async_req_workers();
 #endif
 
+  // same for the transfer buffers (with PSRAM, otherwise on first use). if this fails, requests fall back to the heap.
+  bufferPool.begin();
+
 #ifdef PSYCHIC_WS_RX_STATIC_BUFFER
   // Pre-allocate the shared WS RX buffer now, while the heap is still fresh.
   // (Idempotent; a lazy fallback in PsychicWebSocket.cpp covers any path that
@@ -213,6 +216,10 @@ esp_err_t PsychicHttpServer::stop()
     return ret;
   }
 
+  // give the buffers back until the next start()
+  bufferPool.end();
+  jsonPool.end();
+
   ESP_LOGI(PH_TAG, "Server stopped");
   _running = false;
   return ret;
@@ -767,6 +774,33 @@ std::string urlEncode(const char* str) { return _urlEncode_impl(str); }
 std::string urlDecode(const char* encoded) { return _urlDecode_impl(encoded); }
 #endif
 
+bool etagMatches(const char* header, const char* etag)
+{
+  if (etag[0] == 'W' && etag[1] == '/')
+    etag += 2;
+  size_t len = strlen(etag);
+
+  while (*header) {
+    while (*header == ' ' || *header == ',')
+      header++;
+    if (*header == '*')
+      return true;
+    if (header[0] == 'W' && header[1] == '/')
+      header += 2;
+
+    const char* end = strchr(header, ',');
+    size_t n = end ? end - header : strlen(header);
+    while (n && header[n - 1] == ' ')
+      n--;
+    if (n == len && strncmp(header, etag, len) == 0)
+      return true;
+
+    header = end ? end : header + strlen(header);
+  }
+
+  return false;
+}
+
 bool psychic_uri_match_simple(const char* uri1, const char* uri2, size_t len2)
 {
   return strlen(uri1) == len2 &&           // First match lengths
@@ -1,6 +1,7 @@
 #ifndef PsychicHttpServer_h
 #define PsychicHttpServer_h
 
+#include "PsychicBufferPool.h"
 #include "PsychicClient.h"
 #include "PsychicCore.h"
 #include "PsychicHandler.h"
@@ -65,6 +66,12 @@ class PsychicHttpServer
     unsigned long maxUploadSize;
     unsigned long maxRequestBodySize;
 
+    // transfer buffers for file, upload and JSON bodies, see PsychicBufferPool
+    PsychicBufferPool bufferPool;
+
+    // slabs for the JSON documents of PsychicJsonHandler and PsychicJsonResponse, see PsychicJsonAllocator
+    PsychicSlabPool jsonPool;
+
     PsychicEndpoint* defaultEndpoint;
 
     static void destroy(void* ctx);
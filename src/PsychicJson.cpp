@@ -1,19 +1,44 @@
 #include "PsychicJson.h"
+#include "PsychicHttpServer.h"
+#include "esp_timer.h"
+
+// "application/msgpack" or the older "application/x-msgpack", parameters allowed
+static bool isMsgPackType(const char* type)
+{
+  for (const char* msgPack : {"application/msgpack", "application/x-msgpack"}) {
+    size_t len = strlen(msgPack);
+    if (strncasecmp(type, msgPack, len) == 0 && (type[len] == '\0' || type[len] == ';' || type[len] == ' '))
+      return true;
+  }
+  return false;
+}
+
+// only if the client names MessagePack and likes it at least as much as JSON, so */* stays JSON
+static bool prefersMsgPack(PsychicRequest* request)
+{
+  float msgPack = std::max(request->acceptQuality("application/msgpack"), request->acceptQuality("application/x-msgpack"));
+  return msgPack > 0 && msgPack >= request->acceptQuality(JSON_MIMETYPE);
+}
 
 #ifdef ARDUINOJSON_6_COMPATIBILITY
 PsychicJsonResponse::PsychicJsonResponse(PsychicResponse* response, bool isArray, size_t maxJsonBufferSize) : __response(response),
                                                                                                               _jsonBuffer(maxJsonBufferSize)
 {
-  response->setContentType(JSON_MIMETYPE);
+  response->addHeader("Vary", "Accept");
+  setMsgPack(prefersMsgPack(response->getRequest()));
   if (isArray)
     _root = _jsonBuffer.createNestedArray();
   else
     _root = _jsonBuffer.createNestedObject();
 }
 #else
-PsychicJsonResponse::PsychicJsonResponse(PsychicResponse* response, bool isArray) : PsychicResponseDelegate(response)
+PsychicJsonResponse::PsychicJsonResponse(PsychicResponse* response, bool isArray) : PsychicResponseDelegate(response),
+                                                                                    _allocator(&response->getRequest()->server()->jsonPool),
+                                                                                    _jsonBuffer(&_allocator)
 {
-  setContentType(JSON_MIMETYPE);
+  // caches must keep the JSON and MessagePack copies apart
+  addHeader("Vary", "Accept");
+  setMsgPack(prefersMsgPack(response->getRequest()));
   if (isArray)
     _root = _jsonBuffer.add<JsonArray>();
   else
@@ -28,67 +53,277 @@ JsonVariant& PsychicJsonResponse::getRoot()
 
 size_t PsychicJsonResponse::getLength()
 {
-  return measureJson(_root);
+  return _msgPack ? measureMsgPack(_root) : measureJson(_root);
+}
+
+void PsychicJsonResponse::setMsgPack(bool msgPack)
+{
+  _msgPack = msgPack;
+  setContentType(_msgPack ? MSGPACK_MIMETYPE : JSON_MIMETYPE);
+}
+
+size_t PsychicJsonWriter::write(const uint8_t* data, size_t len)
+{
+  size_t written = 0;
+  while (written < len && _err == ESP_OK) {
+    size_t n = std::min(len - written, _size - _pos);
+    memcpy(_buffer + _pos, data + written, n);
+    _pos += n;
+    written += n;
+
+    if (_pos == _size) {
+      _err = _response->sendData(_buffer, _pos);
+      _pos = 0;
+    }
+  }
+  return written;
+}
+
+esp_err_t PsychicJsonWriter::finish()
+{
+  if (_pos && _err == ESP_OK)
+    _err = _response->sendData(_buffer, _pos);
+  _pos = 0;
+  return _err;
 }
 
 esp_err_t PsychicJsonResponse::send()
 {
   esp_err_t err = ESP_OK;
   size_t length = getLength();
-  size_t buffer_size;
-  char* buffer;
 
-  // how big of a buffer do we want?
-  if (length < JSON_BUFFER_SIZE)
-    buffer_size = length + 1;
-  else
-    buffer_size = JSON_BUFFER_SIZE;
-
-  buffer = (char*)malloc(buffer_size);
-  if (buffer == NULL) {
-    return error(HTTPD_500_INTERNAL_SERVER_ERROR, "Unable to allocate memory.");
+  // the whole document if it fits, otherwise it streams through whatever buffer we got
+  PsychicPooledBuffer buffer(&getRequest()->server()->bufferPool, std::min(length + 1, (size_t)PSYCHIC_POOL_SMALL_SIZE), std::min(length + 1, (size_t)JSON_BUFFER_SIZE));
+  if (!buffer) {
+    addHeader("Retry-After", "1");
+    return _response->send(503);
   }
 
-  // send it in one shot or no?
-  if (length < JSON_BUFFER_SIZE) {
-    serializeJson(_root, buffer, buffer_size);
-
-    setContent((uint8_t*)buffer, length);
-    setContentType(JSON_MIMETYPE);
+  setContentType(_msgPack ? MSGPACK_MIMETYPE : JSON_MIMETYPE);
 
+  // send it in one shot or no?
+  if (length < buffer.size()) {
+    if (_msgPack)
+      serializeMsgPack(_root, buffer.data(), buffer.size());
+    else
+      serializeJson(_root, (char*)buffer.data(), buffer.size());
+    setContent(buffer.data(), length);
     err = _response->send();
   } else {
-#ifdef ARDUINO
-    // helper class that acts as a stream to print chunked responses
-    ChunkPrinter dest(_response, (uint8_t*)buffer, buffer_size);
+    // measureJson() already told us the length, so no chunk framing and no second copy of the document
+    err = sendHeaders(length);
+    if (err == ESP_OK) {
+      PsychicJsonWriter writer(_response, buffer.data(), buffer.size());
+      if (_msgPack)
+        serializeMsgPack(_root, writer);
+      else
+        serializeJson(_root, writer);
+      err = writer.finish();
+    }
+  }
+
+  return err;
+}
 
-    // keep our headers
-    sendHeaders();
+PsychicJsonSnapshot::PsychicJsonSnapshot(PsychicJsonFillCallback fill, bool isArray) : _fill(fill),
+                                                                                       _isArray(isArray),
+                                                                                       _version(1),
+                                                                                       _json({0, nullptr}),
+                                                                                       _msgPack({0, nullptr})
+{
+  _lock = xSemaphoreCreateMutex();
+}
 
-    serializeJson(_root, dest);
+PsychicJsonSnapshot::~PsychicJsonSnapshot()
+{
+  vSemaphoreDelete(_lock);
+}
 
-    // send the last bits
-    dest.flush();
+uint32_t PsychicJsonSnapshot::update()
+{
+  xSemaphoreTake(_lock, portMAX_DELAY);
+  uint32_t version = ++_version;
+  xSemaphoreGive(_lock);
+  return version;
+}
+
+uint32_t PsychicJsonSnapshot::version()
+{
+  xSemaphoreTake(_lock, portMAX_DELAY);
+  uint32_t version = _version;
+  xSemaphoreGive(_lock);
+  return version;
+}
 
-    // done with our chunked response too
-    err = finishChunking();
+// fill a fresh document and serialize it. Called locked.
+std::shared_ptr<const std::string> PsychicJsonSnapshot::_serialize(PsychicRequest* request, bool msgPack)
+{
+#ifdef ARDUINOJSON_6_COMPATIBILITY
+  DynamicJsonDocument doc(DYNAMIC_JSON_DOCUMENT_SIZE);
 #else
-    // In native IDF, reallocate to full length and send in one shot
-    free(buffer);
-    buffer = (char*)malloc(length + 1);
-    if (!buffer)
-      return error(HTTPD_500_INTERNAL_SERVER_ERROR, "Unable to allocate memory.");
-    serializeJson(_root, buffer, length + 1);
-    setContent((uint8_t*)buffer, length);
-    setContentType(JSON_MIMETYPE);
-    err = _response->send();
+  PsychicJsonAllocator allocator(&request->server()->jsonPool);
+  JsonDocument doc(&allocator);
 #endif
+  if (_isArray)
+    doc.to<JsonArray>();
+  else
+    doc.to<JsonObject>();
+  JsonVariant root = doc.as<JsonVariant>();
+  _fill(root);
+
+  size_t length = msgPack ? measureMsgPack(root) : measureJson(root);
+  std::string* body = new std::string(length + 1, '\0');
+  if (msgPack)
+    serializeMsgPack(root, &(*body)[0], length + 1);
+  else
+    serializeJson(root, &(*body)[0], length + 1);
+  body->resize(length);
+
+  return std::shared_ptr<const std::string>(body);
+}
+
+esp_err_t PsychicJsonSnapshot::send(PsychicRequest* request, PsychicResponse* response)
+{
+  bool msgPack = prefersMsgPack(request);
+
+  xSemaphoreTake(_lock, portMAX_DELAY);
+  uint32_t version = _version;
+  xSemaphoreGive(_lock);
+
+  // the representations differ, so their ETags must too
+  const char* format = msgPack ? "\"v%u-msgpack\"" : "\"v%u\"";
+  char etag[24];
+  snprintf(etag, sizeof(etag), format, (unsigned)version);
+  response->addHeader("ETag", etag);
+  response->addHeader("Cache-Control", "no-cache");
+  response->addHeader("Vary", "Accept");
+
+  // the cheapest poll there is, the document isn't even looked at
+  if (request->hasHeader("If-None-Match") && etagMatches(request->headerCStr("If-None-Match"), etag))
+    return response->send(304);
+
+  // the body is shared, so a request still sending the old version keeps it alive after an update
+  xSemaphoreTake(_lock, portMAX_DELAY);
+  Cache& cache = msgPack ? _msgPack : _json;
+  if (!cache.body || cache.version != _version) {
+    cache.body = _serialize(request, msgPack);
+    cache.version = _version;
   }
+  std::shared_ptr<const std::string> body = cache.body;
+  uint32_t built = cache.version;
+  xSemaphoreGive(_lock);
 
-  // let the buffer go
-  free(buffer);
+  // updated since the ETag was set
+  if (built != version) {
+    snprintf(etag, sizeof(etag), format, (unsigned)built);
+    response->addHeader("ETag", etag);
+  }
 
-  return err;
+  return response->send(200, msgPack ? MSGPACK_MIMETYPE : JSON_MIMETYPE, (const uint8_t*)body->data(), body->size());
+}
+
+PsychicNdjsonResponse::PsychicNdjsonResponse(PsychicResponse* response, size_t maxRecordSize) : PsychicResponseDelegate(response),
+                                                                                                _buffer(&response->getRequest()->server()->bufferPool),
+                                                                                                _printer(nullptr),
+                                                                                                _maxRecordSize(maxRecordSize),
+                                                                                                _err(ESP_OK)
+{
+  setContentType(NDJSON_MIMETYPE);
+}
+
+PsychicNdjsonResponse::~PsychicNdjsonResponse()
+{
+  endSend();
+}
+
+esp_err_t PsychicNdjsonResponse::beginSend()
+{
+  if (_printer)
+    return ESP_OK;
+
+  // one record must always fit, more of them make for fewer chunks
+  if (!_buffer.acquire(_maxRecordSize, std::max(_maxRecordSize, (size_t)JSON_BUFFER_SIZE))) {
+    addHeader("Retry-After", "1");
+    _response->send(503);
+    return _err = ESP_FAIL;
+  }
+
+  _printer = new ChunkPrinter(_response, _buffer.data(), _buffer.size());
+  sendHeaders();
+  return ESP_OK;
+}
+
+esp_err_t PsychicNdjsonResponse::endSend()
+{
+  if (!_printer)
+    return _err == ESP_OK ? ESP_FAIL : _err;
+
+  esp_err_t err = _printer->finish();
+  delete _printer;
+  _printer = nullptr;
+
+  if (_err == ESP_OK)
+    _err = err;
+  if (_err == ESP_OK)
+    _err = finishChunking();
+  return _err;
+}
+
+esp_err_t PsychicNdjsonResponse::add(JsonVariantConst record)
+{
+  if (!_printer)
+    return ESP_FAIL;
+  if (_err != ESP_OK)
+    return _err;
+
+  size_t length = measureJson(record);
+  if (length + 1 > _maxRecordSize) {
+    ESP_LOGE(PH_TAG, "NDJSON record of %u bytes skipped, the limit is %u", (unsigned)length + 1, (unsigned)_maxRecordSize);
+    return ESP_ERR_INVALID_SIZE;
+  }
+
+  // serializeJson() ends with a NUL, which is where the newline goes
+  uint8_t* line = _printer->reserve(length + 1);
+  if (!line)
+    return _err = ESP_FAIL;
+  serializeJson(record, (char*)line, length + 1);
+  line[length] = '\n';
+  _printer->commit(length + 1);
+
+  return ESP_OK;
+}
+
+void PsychicNdjsonResponse::flush()
+{
+  if (_printer)
+    _printer->flush();
+}
+
+esp_err_t PsychicNdjsonResponse::send(PsychicNdjsonCallback callback)
+{
+  esp_err_t err = beginSend();
+  if (err != ESP_OK)
+    return err;
+
+#ifdef ARDUINOJSON_6_COMPATIBILITY
+  DynamicJsonDocument doc(DYNAMIC_JSON_DOCUMENT_SIZE);
+#else
+  PsychicJsonAllocator allocator(&getRequest()->server()->jsonPool);
+  JsonDocument doc(&allocator);
+#endif
+
+  for (size_t index = 0;; index++) {
+    JsonVariant record = doc.to<JsonVariant>();
+    if (!callback(index, record))
+      break;
+
+    // an oversized record is logged and left out, a dead connection ends the export
+    err = add(doc.as<JsonVariant>());
+    if (err != ESP_OK && err != ESP_ERR_INVALID_SIZE)
+      break;
+  }
+
+  return endSend();
 }
 
 #ifdef ARDUINOJSON_6_COMPATIBILITY
@@ -120,14 +355,16 @@ esp_err_t PsychicJsonHandler::handleRequest(PsychicRequest* request, PsychicResp
   if (_onRequest) {
 #ifdef ARDUINOJSON_6_COMPATIBILITY
     DynamicJsonDocument jsonBuffer(this->_maxJsonBufferSize);
-    DeserializationError error = deserializeJson(jsonBuffer, request->body());
+    DeserializationError error = isMsgPackType(request->headerCStr("Content-Type")) ? deserializeMsgPack(jsonBuffer, request->bodyCStr(), request->bodyLength()) : deserializeJson(jsonBuffer, request->body());
     if (error)
       return response->send(400);
 
     JsonVariant json = jsonBuffer.as<JsonVariant>();
 #else
-    JsonDocument jsonBuffer;
-    DeserializationError error = deserializeJson(jsonBuffer, request->body());
+    PsychicJsonAllocator allocator(&request->server()->jsonPool);
+    JsonDocument jsonBuffer(&allocator);
+    // MessagePack bodies are binary, so they go by length
+    DeserializationError error = isMsgPackType(request->headerCStr("Content-Type")) ? deserializeMsgPack(jsonBuffer, request->bodyCStr(), request->bodyLength()) : deserializeJson(jsonBuffer, request->body());
     if (error)
       return response->send(400);
 
@@ -137,4 +374,151 @@ esp_err_t PsychicJsonHandler::handleRequest(PsychicRequest* request, PsychicResp
     return _onRequest(request, response, json);
   } else
     return response->send(500);
-}
\ No newline at end of file
+}
+
+static JsonObject addObject(JsonVariant array)
+{
+#ifdef ARDUINOJSON_6_COMPATIBILITY
+  return array.createNestedObject();
+#else
+  return array.add<JsonObject>();
+#endif
+}
+
+static void rpcError(JsonObject out, int code, const char* message)
+{
+  JsonObject error = out["error"].to<JsonObject>();
+  error["code"] = code;
+  error["message"] = message;
+}
+
+#ifdef ARDUINOJSON_6_COMPATIBILITY
+PsychicJsonRpcHandler::PsychicJsonRpcHandler(size_t maxJsonBufferSize) : _timing(false),
+                                                                         _maxJsonBufferSize(maxJsonBufferSize)
+{
+}
+#else
+PsychicJsonRpcHandler::PsychicJsonRpcHandler() : _timing(false)
+{
+}
+#endif
+
+PsychicJsonRpcHandler* PsychicJsonRpcHandler::on(const char* method, PsychicJsonRpcCallback fn)
+{
+  _methods[method] = fn;
+  return this;
+}
+
+PsychicJsonRpcHandler* PsychicJsonRpcHandler::setTiming(bool timing)
+{
+  _timing = timing;
+  return this;
+}
+
+bool PsychicJsonRpcHandler::_call(PsychicRequest* request, JsonVariantConst call, JsonObject out, std::string* timing, size_t index)
+{
+  out["jsonrpc"] = "2.0";
+
+  const char* version = call["jsonrpc"].as<const char*>();
+  const char* method = call["method"].as<const char*>();
+  JsonVariantConst params = call["params"];
+  if (!call.is<JsonObjectConst>() || !version || strcmp(version, "2.0") != 0 || !method ||
+      !(params.isNull() || params.is<JsonArrayConst>() || params.is<JsonObjectConst>())) {
+    rpcError(out, PSYCHIC_RPC_INVALID_REQUEST, "Invalid Request");
+    out["id"] = call["id"];
+    return true;
+  }
+
+  int64_t start = esp_timer_get_time();
+
+  auto it = _methods.find(method);
+  if (it == _methods.end())
+    rpcError(out, PSYCHIC_RPC_METHOD_NOT_FOUND, "Method not found");
+  else {
+    JsonVariant result = out["result"].to<JsonVariant>();
+    int code = it->second(request, params, result);
+    if (code) {
+      // the message may live in result, so copy it before result goes
+      std::string message = result.is<const char*>() ? result.as<const char*>() : "Server error";
+      out.remove("result");
+      rpcError(out, code, message.c_str());
+    }
+  }
+
+  if (timing) {
+    // call<n>;desc="<method>";dur=<ms>, quotes and backslashes would end the desc early
+    char entry[96];
+    snprintf(entry, sizeof(entry), "%scall%u;desc=\"", timing->empty() ? "" : ", ", (unsigned)index);
+    *timing += entry;
+    for (const char* p = method; *p && p - method < 48; p++)
+      if (*p != '"' && *p != '\\')
+        *timing += *p;
+    snprintf(entry, sizeof(entry), "\";dur=%.2f", (esp_timer_get_time() - start) / 1000.0);
+    *timing += entry;
+  }
+
+  // no id, no reply
+  if (call["id"].isNull())
+    return false;
+  out["id"] = call["id"];
+  return true;
+}
+
+esp_err_t PsychicJsonRpcHandler::handleRequest(PsychicRequest* request, PsychicResponse* response)
+{
+  // process basic stuff
+  PsychicWebHandler::handleRequest(request, response);
+
+  int64_t start = esp_timer_get_time();
+
+#ifdef ARDUINOJSON_6_COMPATIBILITY
+  DynamicJsonDocument doc(this->_maxJsonBufferSize);
+#else
+  PsychicJsonAllocator allocator(&request->server()->jsonPool);
+  JsonDocument doc(&allocator);
+#endif
+  DeserializationError error = isMsgPackType(request->headerCStr("Content-Type")) ? deserializeMsgPack(doc, request->bodyCStr(), request->bodyLength()) : deserializeJson(doc, request->body());
+  JsonVariantConst body = doc.as<JsonVariantConst>();
+  bool batch = !error && body.is<JsonArrayConst>() && body.as<JsonArrayConst>().size() > 0;
+
+  std::string timing;
+  if (_timing) {
+    char entry[32];
+    snprintf(entry, sizeof(entry), "parse;dur=%.2f", (esp_timer_get_time() - start) / 1000.0);
+    timing = entry;
+  }
+
+  // the replies go into one document, an array for a batch
+  PsychicJsonResponse json(response, batch);
+  JsonVariant root = json.getRoot();
+  bool reply = false;
+
+  if (error) {
+    JsonObject out = root.as<JsonObject>();
+    out["jsonrpc"] = "2.0";
+    rpcError(out, PSYCHIC_RPC_PARSE_ERROR, "Parse error");
+    out["id"] = nullptr;
+    reply = true;
+  } else if (batch) {
+    size_t index = 0;
+    for (JsonVariantConst call : body.as<JsonArrayConst>()) {
+      JsonArray replies = root.as<JsonArray>();
+      if (_call(request, call, addObject(root), _timing ? &timing : nullptr, index++))
+        reply = true;
+      else
+        replies.remove(replies.size() - 1);
+    }
+  } else
+    reply = _call(request, body, root.as<JsonObject>(), _timing ? &timing : nullptr, 0);
+
+  if (_timing) {
+    ESP_LOGD(PH_TAG, "JSON-RPC %s", timing.c_str());
+    json.addHeader("Server-Timing", timing.c_str());
+  }
+
+  // nothing but notifications
+  if (!reply)
+    return response->send(204);
+
+  return json.send();
+}
@@ -9,9 +9,11 @@
 #define PSYCHIC_JSON_H_
 
 #include "ChunkPrinter.h"
+#include "PsychicBufferPool.h"
 #include "PsychicRequest.h"
 #include "PsychicWebHandler.h"
 #include <ArduinoJson.h>
+#include <memory>
 
 #if ARDUINOJSON_VERSION_MAJOR == 6
   #define ARDUINOJSON_6_COMPATIBILITY
@@ -25,6 +27,64 @@
 #endif
 
 constexpr const char* JSON_MIMETYPE = "application/json";
+constexpr const char* MSGPACK_MIMETYPE = "application/msgpack";
+constexpr const char* NDJSON_MIMETYPE = "application/x-ndjson";
+
+// longest NDJSON record, newline included. Each one is serialized straight into the chunk buffer.
+#ifndef PSYCHIC_NDJSON_MAX_RECORD
+  #define PSYCHIC_NDJSON_MAX_RECORD 512
+#endif
+
+/*
+ * Json Allocator
+ * */
+
+#if ARDUINOJSON_VERSION_MAJOR >= 7
+// Lets a JsonDocument take its memory from a PsychicSlabPool, usually the server's jsonPool:
+//
+//   PsychicJsonAllocator allocator(&server.jsonPool);
+//   JsonDocument doc(&allocator);
+//
+// The allocator must outlive the document.
+class PsychicJsonAllocator : public ArduinoJson::Allocator
+{
+  private:
+    PsychicSlabPool* _pool;
+
+  public:
+    explicit PsychicJsonAllocator(PsychicSlabPool* pool) : _pool(pool) {}
+
+    void* allocate(size_t size) override { return _pool->allocate(size); }
+    void deallocate(void* ptr) override { _pool->release(ptr); }
+    void* reallocate(void* ptr, size_t size) override { return _pool->reallocate(ptr, size); }
+};
+#endif
+
+/*
+ * Json Writer
+ * */
+
+// Streams serializeJson() output into a fixed-length body: the caller announces the measured
+// length with sendHeaders(size_t), then every full buffer goes out with sendData(). Not a Print,
+// ArduinoJson takes any class with these two write()s, so it works the same on IDF and Arduino.
+class PsychicJsonWriter
+{
+  private:
+    PsychicResponse* _response;
+    uint8_t* _buffer;
+    size_t _size;
+    size_t _pos;
+    esp_err_t _err;
+
+  public:
+    PsychicJsonWriter(PsychicResponse* response, uint8_t* buffer, size_t size) : _response(response), _buffer(buffer), _size(size), _pos(0), _err(ESP_OK) {}
+
+    size_t write(uint8_t c) { return write(&c, 1); }
+    size_t write(const uint8_t* data, size_t len);
+
+    // send what is left in the buffer, returns the first error
+    esp_err_t finish();
+};
 
 /*
  * Json Response
@@ -38,11 +98,13 @@ class PsychicJsonResponse : public PsychicResponseDelegate
 #elif ARDUINOJSON_VERSION_MAJOR == 6
     DynamicJsonDocument _jsonBuffer;
 #else
+    PsychicJsonAllocator _allocator; // before _jsonBuffer, which needs it until the end
     JsonDocument _jsonBuffer;
 #endif
 
     JsonVariant _root;
     size_t _contentLength;
+    bool _msgPack;
 
   public:
 #ifdef ARDUINOJSON_5_COMPATIBILITY
@@ -60,9 +122,100 @@ class PsychicJsonResponse : public PsychicResponseDelegate
     JsonVariant& getRoot();
     size_t getLength();
 
+    // MessagePack instead of JSON. Picked from the request's Accept header, this overrides it.
+    void setMsgPack(bool msgPack);
+    bool isMsgPack() { return _msgPack; }
+
     esp_err_t send();
 };
 
+/*
+ * Json Snapshot
+ * */
+
+// A document that only changes when the application says so. It is filled and serialized once
+// per version, every GET after that copies the cached bytes or answers 304 Not Modified.
+//
+//   PsychicJsonSnapshot state([](JsonVariant& root) { root["temp"] = temperature; });
+//   server.on("/api/state", [](PsychicRequest* request, PsychicResponse* response) { return state.send(request, response); });
+//   ...
+//   state.update(); // temperature changed
+class PsychicJsonSnapshot
+{
+  private:
+    // one per representation, each rebuilt lazily
+    struct Cache {
+        uint32_t version;
+        std::shared_ptr<const std::string> body;
+    };
+
+    PsychicJsonFillCallback _fill;
+    bool _isArray;
+    uint32_t _version;
+    Cache _json;
+    Cache _msgPack;
+    SemaphoreHandle_t _lock;
+
+    std::shared_ptr<const std::string> _serialize(PsychicRequest* request, bool msgPack);
+
+  public:
+    // fill runs on the server task that first asks for a version, and must not call update()
+    PsychicJsonSnapshot(PsychicJsonFillCallback fill, bool isArray = false);
+    ~PsychicJsonSnapshot();
+
+    PsychicJsonSnapshot(const PsychicJsonSnapshot&) = delete;
+    PsychicJsonSnapshot& operator=(const PsychicJsonSnapshot&) = delete;
+
+    // the data changed, the next request fills the document again. Returns the new version.
+    uint32_t update();
+    uint32_t version();
+
+    // 200 with the cached body and ETag: "v<version>", or 304 if If-None-Match has that ETag
+    esp_err_t send(PsychicRequest* request, PsychicResponse* response);
+};
+
+/*
+ * Ndjson Response
+ * */
+
+// Newline delimited JSON, one small record at a time, so an export of any length runs in one
+// chunk buffer. Compose with enableCompression() before beginSend() to gzip it on the way.
+//
+//   PsychicNdjsonResponse ndjson(response);
+//   return ndjson.send([](size_t index, JsonVariant& record) {
+//     if (index >= logCount)
+//       return false;
+//     record["t"] = log[index].time;
+//     record["msg"] = log[index].message;
+//     return true;
+//   });
+class PsychicNdjsonResponse : public PsychicResponseDelegate
+{
+  private:
+    PsychicPooledBuffer _buffer;
+    ChunkPrinter* _printer;
+    size_t _maxRecordSize;
+    esp_err_t _err;
+
+  public:
+    PsychicNdjsonResponse(PsychicResponse* response, size_t maxRecordSize = PSYCHIC_NDJSON_MAX_RECORD);
+    ~PsychicNdjsonResponse();
+
+    esp_err_t beginSend();
+    esp_err_t endSend();
+
+    // serialize one record and a newline. A record longer than maxRecordSize is skipped with
+    // ESP_ERR_INVALID_SIZE, the stream goes on.
+    esp_err_t add(JsonVariantConst record);
+
+    // send what is buffered, e.g. for a live tail, see ChunkPrinter::flush()
+    void flush();
+
+    // beginSend(), one record per call until the callback returns false, endSend().
+    // The record lives in one document that is emptied for every call.
+    esp_err_t send(PsychicNdjsonCallback callback);
+};
+
 class PsychicJsonHandler : public PsychicWebHandler
 {
   protected:
@@ -87,4 +240,56 @@ class PsychicJsonHandler : public PsychicWebHandler
     virtual esp_err_t handleRequest(PsychicRequest* request, PsychicResponse* response) override;
 };
 
+/*
+ * Json-RPC Handler
+ * */
+
+// JSON-RPC 2.0 error codes
+#define PSYCHIC_RPC_PARSE_ERROR      -32700
+#define PSYCHIC_RPC_INVALID_REQUEST  -32600
+#define PSYCHIC_RPC_METHOD_NOT_FOUND -32601
+#define PSYCHIC_RPC_INVALID_PARAMS   -32602
+#define PSYCHIC_RPC_INTERNAL_ERROR   -32603
+
+// JSON-RPC 2.0 over POST. A batch is dispatched call by call against one parsed document and
+// answered with one array, so a page can make all its startup calls in a single round trip.
+//
+//   PsychicJsonRpcHandler* rpc = new PsychicJsonRpcHandler();
+//   rpc->on("led.set", [](PsychicRequest* request, JsonVariantConst params, JsonVariant& result) {
+//     setLed(params["on"]);
+//     result = true;
+//     return 0;
+//   });
+//   server.on("/rpc", HTTP_POST, rpc);
+//
+// A callback fills result and returns 0, or returns an error code. A string left in result
+// then becomes the error message.
+class PsychicJsonRpcHandler : public PsychicWebHandler
+{
+  protected:
+    std::map<std::string, PsychicJsonRpcCallback> _methods;
+    bool _timing;
+#if ARDUINOJSON_VERSION_MAJOR == 6
+    const size_t _maxJsonBufferSize = DYNAMIC_JSON_DOCUMENT_SIZE;
+#endif
+
+    // one call into out, false if it was a notification and needs no reply
+    bool _call(PsychicRequest* request, JsonVariantConst call, JsonObject out, std::string* timing, size_t index);
+
+  public:
+#if ARDUINOJSON_VERSION_MAJOR == 6
+    PsychicJsonRpcHandler(size_t maxJsonBufferSize = DYNAMIC_JSON_DOCUMENT_SIZE);
+#else
+    PsychicJsonRpcHandler();
+#endif
+
+    PsychicJsonRpcHandler* on(const char* method, PsychicJsonRpcCallback fn);
+
+    // debug aid: a Server-Timing header with the parse time and each call's time, which the
+    // browser's network panel shows per request
+    PsychicJsonRpcHandler* setTiming(bool timing);
+
+    virtual esp_err_t handleRequest(PsychicRequest* request, PsychicResponse* response) override;
+};
+
 #endif
\ No newline at end of file
@@ -1,4 +1,5 @@
 #include "PsychicMiddlewares.h"
+#include <strings.h>
 
 #ifdef ARDUINO
 void LoggingMiddleware::setOutput(Print& output)
@@ -197,3 +198,185 @@ esp_err_t CorsMiddleware::run(PsychicRequest* request, PsychicResponse* response
   }
   return next();
 }
+
+// event group bit set once the leading request has finished
+#define FLIGHT_DONE_BIT (1 << 0)
+
+CoalescingMiddleware::CoalescingMiddleware() : _lock(xSemaphoreCreateMutex())
+{
+  if (_lock == NULL)
+    ESP_LOGE(PH_TAG, "CoalescingMiddleware: unable to create mutex, coalescing disabled");
+}
+
+CoalescingMiddleware::~CoalescingMiddleware()
+{
+  _flights.clear();
+  if (_lock)
+    vSemaphoreDelete(_lock);
+}
+
+CoalescingMiddleware& CoalescingMiddleware::setTimeout(uint32_t ms)
+{
+  _timeout = ms;
+  return *this;
+}
+
+CoalescingMiddleware& CoalescingMiddleware::setFallback(CoalescingFallback fallback)
+{
+  _fallback = fallback;
+  return *this;
+}
+
+CoalescingMiddleware& CoalescingMiddleware::setMaxBodySize(size_t bytes)
+{
+  _maxBodySize = bytes;
+  return *this;
+}
+
+CoalescingMiddleware& CoalescingMiddleware::setKeyFunction(CoalescingKeyFunction fn)
+{
+  _keyFn = fn;
+  return *this;
+}
+
+CoalescingMiddleware& CoalescingMiddleware::setMaxWaiters(size_t waiters)
+{
+  _maxWaiters = waiters;
+  return *this;
+}
+
+uint32_t CoalescingMiddleware::coalescedCount()
+{
+  if (_lock == NULL)
+    return 0;
+
+  xSemaphoreTake(_lock, portMAX_DELAY);
+  uint32_t count = _coalesced;
+  xSemaphoreGive(_lock);
+  return count;
+}
+
+// headers that make a response specific to the client that sent them
+static const char* const coalesceExcluded[] = {
+  "Authorization",
+  "Cookie",
+  "Range",
+  "If-Range",
+  "If-None-Match",
+  "If-Modified-Since",
+  "If-Match",
+  "If-Unmodified-Since",
+};
+
+// the URI plus the headers the response is negotiated on
+static std::string coalesceKey(PsychicRequest* request)
+{
+  std::string key(request->uriCStr());
+  key += '\n';
+  key += request->headerCStr("Accept");
+  key += '\n';
+  key += request->headerCStr("Accept-Encoding");
+  return key;
+}
+
+esp_err_t CoalescingMiddleware::run(PsychicRequest* request, PsychicResponse* response, PsychicMiddlewareNext next)
+{
+  // only idempotent requests may share a response
+  if (request->method() != HTTP_GET || _lock == NULL)
+    return next();
+
+  // conditional, partial or credentialed requests get an answer of their own
+  for (const char* header : coalesceExcluded)
+    if (request->hasHeader(header))
+      return next();
+
+  std::string key = _keyFn ? _keyFn(request) : coalesceKey(request);
+  if (key.empty())
+    return next();
+
+  std::shared_ptr<Flight> flight;
+  bool leader = false;
+
+  xSemaphoreTake(_lock, portMAX_DELAY);
+  auto it = _flights.find(key);
+  if (it != _flights.end()) {
+    // don't tie up more workers behind one slow leader
+    if (it->second->waiters < _maxWaiters) {
+      flight = it->second;
+      flight->waiters++;
+    }
+  } else {
+    flight = std::make_shared<Flight>();
+    if (flight->done) {
+      _flights[key] = flight;
+      leader = true;
+    }
+  }
+  xSemaphoreGive(_lock);
+
+  // too many waiters already, or no event group because we are out of memory: just get on with it.
+  if (!flight || !flight->done)
+    return next();
+
+  if (leader)
+    return _lead(key, flight, response, next);
+
+  // somebody is already producing this response, wait for them.
+  EventBits_t bits = xEventGroupWaitBits(flight->done, FLIGHT_DONE_BIT, pdFALSE, pdTRUE, pdMS_TO_TICKS(_timeout));
+
+  xSemaphoreTake(_lock, portMAX_DELAY);
+  flight->waiters--;
+  xSemaphoreGive(_lock);
+  if ((bits & FLIGHT_DONE_BIT) && flight->shareable) {
+    xSemaphoreTake(_lock, portMAX_DELAY);
+    _coalesced++;
+    xSemaphoreGive(_lock);
+
+    ESP_LOGD(PH_TAG, "Request %s answered from in-flight response", request->uriCStr());
+    return _replay(flight->capture, response);
+  }
+
+  ESP_LOGD(PH_TAG, "Request %s could not be coalesced (%s)", request->uriCStr(), (bits & FLIGHT_DONE_BIT) ? "not shareable" : "timeout");
+
+  if (_fallback == COALESCE_SEND_BUSY)
+    return response->send(503, "text/html", "Server busy.");
+
+  return next();
+}
+
+esp_err_t CoalescingMiddleware::_lead(const std::string& key, std::shared_ptr<Flight> flight, PsychicResponse* response, PsychicMiddlewareNext next)
+{
+  flight->capture.limit = _maxBodySize;
+
+  response->captureTo(&flight->capture);
+  esp_err_t ret = next();
+  response->captureTo(nullptr);
+
+  // anything that didn't go out through PsychicResponse in one piece (errors, raw sends, oversized bodies) can't be shared.
+  flight->shareable = ret == ESP_OK && flight->capture.complete && !flight->capture.overflowed;
+
+  // retire the flight before waking the waiters, so later requests start a fresh one.
+  xSemaphoreTake(_lock, portMAX_DELAY);
+  auto it = _flights.find(key);
+  if (it != _flights.end() && it->second == flight)
+    _flights.erase(it);
+  xSemaphoreGive(_lock);
+
+  xEventGroupSetBits(flight->done, FLIGHT_DONE_BIT);
+
+  return ret;
+}
+
+esp_err_t CoalescingMiddleware::_replay(const PsychicResponseCapture& capture, PsychicResponse* response)
+{
+  response->setCode(capture.code);
+  response->setContentType(capture.contentType.c_str());
+
+  // cookies belong to the client that made the original request
+  for (auto& header : capture.headers)
+    if (strcasecmp(header.field.c_str(), "Set-Cookie") != 0)
+      response->addHeader(header.field.c_str(), header.value.c_str());
+
+  response->setContent((const uint8_t*)capture.body.data(), capture.body.size());
+  return response->send();
+}
@@ -6,7 +6,11 @@
 #ifdef ARDUINO
   #include <Stream.h>
 #endif
+#include "freertos/FreeRTOS.h"
+#include "freertos/event_groups.h"
+#include "freertos/semphr.h"
 #include <http_status.h>
+#include <memory>
 
 // curl-like logging middleware
 #ifdef ARDUINO
@@ -97,4 +101,70 @@ class CorsMiddleware : public PsychicMiddleware
     uint32_t _maxAge = 86400;
 };
 
+// what a waiting request does when the in-flight response doesn't arrive in time (or can't be shared)
+enum CoalescingFallback {
+  COALESCE_RUN_HANDLER, // run the handler itself, as if there had been no coalescing
+  COALESCE_SEND_BUSY    // answer 503 straight away
+};
+
+typedef std::function<std::string(PsychicRequest* request)> CoalescingKeyFunction;
+
+// single-flight middleware: while one request is producing the response for a key,
+// identical requests wait for it and are answered with a copy of the same bytes.
+// Only useful when requests can run concurrently (ENABLE_ASYNC workers).
+// The default key is the URI plus Accept and Accept-Encoding. Requests with conditional,
+// Range, Authorization or Cookie headers are never coalesced.
+// Every waiting request holds a worker, so only setMaxWaiters() requests wait on one
+// flight; any more run the handler themselves.
+class CoalescingMiddleware : public PsychicMiddleware
+{
+  public:
+    CoalescingMiddleware();
+    ~CoalescingMiddleware();
+
+    CoalescingMiddleware& setTimeout(uint32_t ms);
+    CoalescingMiddleware& setFallback(CoalescingFallback fallback);
+    CoalescingMiddleware& setMaxBodySize(size_t bytes);
+    CoalescingMiddleware& setKeyFunction(CoalescingKeyFunction fn);
+    CoalescingMiddleware& setMaxWaiters(size_t waiters);
+
+    uint32_t getTimeout() const { return _timeout; }
+    CoalescingFallback getFallback() const { return _fallback; }
+    size_t getMaxBodySize() const { return _maxBodySize; }
+    size_t getMaxWaiters() const { return _maxWaiters; }
+
+    // number of requests answered from another request's response
+    uint32_t coalescedCount();
+
+    esp_err_t run(PsychicRequest* request, PsychicResponse* response, PsychicMiddlewareNext next) override;
+
+  private:
+    struct Flight {
+        Flight() : done(xEventGroupCreate()) {}
+        ~Flight()
+        {
+          if (done)
+            vEventGroupDelete(done);
+        }
+
+        EventGroupHandle_t done;
+        PsychicResponseCapture capture;
+        bool shareable = false;
+        size_t waiters = 0;
+    };
+
+    SemaphoreHandle_t _lock;
+    std::map<std::string, std::shared_ptr<Flight>> _flights;
+
+    uint32_t _timeout = 5000;
+    CoalescingFallback _fallback = COALESCE_RUN_HANDLER;
+    size_t _maxBodySize = 32 * 1024;
+    size_t _maxWaiters = 2;
+    CoalescingKeyFunction _keyFn = nullptr;
+    uint32_t _coalesced = 0;
+
+    esp_err_t _lead(const std::string& key, std::shared_ptr<Flight> flight, PsychicResponse* response, PsychicMiddlewareNext next);
+    esp_err_t _replay(const PsychicResponseCapture& capture, PsychicResponse* response);
+};
+
 #endif
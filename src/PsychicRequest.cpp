@@ -80,6 +80,22 @@ void PsychicRequest::setEndpoint(PsychicEndpoint* endpoint)
   _endpoint = endpoint;
 }
 
+void PsychicRequest::setHandlerState(const void* owner, std::shared_ptr<void> state)
+{
+  _handlerState = state;
+  _handlerStateOwner = state ? owner : nullptr;
+}
+
+std::shared_ptr<void> PsychicRequest::takeHandlerState(const void* owner)
+{
+  if (!_handlerState || _handlerStateOwner != owner)
+    return nullptr;
+
+  std::shared_ptr<void> state = std::move(_handlerState);
+  _handlerStateOwner = nullptr;
+  return state;
+}
+
 #ifdef PSY_ENABLE_REGEX
 bool PsychicRequest::getRegexMatches(std::smatch& matches, bool use_full_uri)
 {
@@ -257,7 +273,8 @@ esp_err_t PsychicRequest::loadBody()
   }
 
   buf[actuallyReceived] = '\0';
-  this->_body = buf;
+  // by length, binary bodies like MessagePack can hold NULs
+  this->_body.assign(buf, actuallyReceived);
   free(buf);
 
   _bodyParsed = ESP_OK;
@@ -389,6 +406,55 @@ bool PsychicRequest::hasHeader(const char* name)
   return httpd_req_get_hdr_value_len(this->_req, name) > 0;
 }
 
+// q value of name in a list like "gzip, br;q=0.5", or of wildcard if only that is listed. -1 if neither is.
+static float listQuality(const char* p, const char* name, const char* wildcard)
+{
+  size_t len = strlen(name);
+  size_t wildcardLen = wildcard ? strlen(wildcard) : 0;
+  float found = -1;
+
+  while (*p) {
+    // each entry is "name" or "name;q=0.5", separated by commas
+    while (*p == ' ' || *p == ',')
+      p++;
+    const char* entry = p;
+    while (*p && *p != ',' && *p != ';' && *p != ' ')
+      p++;
+    size_t entryLen = p - entry;
+
+    float q = 1.0;
+    while (*p && *p != ',') {
+      if ((p[0] == 'q' || p[0] == 'Q') && p[1] == '=')
+        q = atof(p + 2);
+      p++;
+    }
+
+    if (entryLen == len && strncasecmp(entry, name, len) == 0)
+      return q;
+    if (wildcard && entryLen == wildcardLen && strncmp(entry, wildcard, wildcardLen) == 0)
+      found = q;
+  }
+
+  return found;
+}
+
+bool PsychicRequest::acceptsEncoding(const char* coding)
+{
+  return encodingQuality(coding) > 0;
+}
+
+float PsychicRequest::encodingQuality(const char* coding)
+{
+  float q = listQuality(_getHeader("Accept-Encoding"), coding, "*");
+  return q > 0 ? q : 0;
+}
+
+float PsychicRequest::acceptQuality(const char* type)
+{
+  float q = listQuality(_getHeader("Accept"), type, nullptr);
+  return q > 0 ? q : 0;
+}
+
 #ifdef ARDUINO
 String PsychicRequest::host()
 {
@@ -433,6 +499,11 @@ const char* PsychicRequest::bodyCStr()
   return _body.c_str();
 }
 
+size_t PsychicRequest::bodyLength()
+{
+  return _body.length();
+}
+
 bool PsychicRequest::isMultipart()
 {
   return strstr(this->_getHeader("Content-Type"), "multipart/form-data") != nullptr;
@@ -6,6 +6,7 @@
 #include "PsychicEndpoint.h"
 #include "PsychicHttpServer.h"
 #include "PsychicWebParameter.h"
+#include <memory>
 
 #ifdef PSY_ENABLE_REGEX
   #include <regex>
@@ -64,6 +65,9 @@ class PsychicRequest
 
     PsychicResponse* _response;
 
+    std::shared_ptr<void> _handlerState;
+    const void* _handlerStateOwner = nullptr;
+
     void _setUri(const char* uri);
     void _addParams(const char* params, bool post);
     void _parseGETParams();
@@ -83,6 +87,11 @@ class PsychicRequest
 
     void* _tempObject;
 
+    // what a handler's canHandle() found out for its handleRequest(), released with the request.
+    // only the owner that set it (usually the handler's this) gets it back, and taking it clears it.
+    void setHandlerState(const void* owner, std::shared_ptr<void> state);
+    std::shared_ptr<void> takeHandlerState(const void* owner);
+
     PsychicHttpServer* server();
     httpd_req_t* request();
     virtual PsychicClient* client();
@@ -107,6 +116,13 @@ class PsychicRequest
     const char* headerCStr(const char* name);
     bool hasHeader(const char* name);
 
+    // true if Accept-Encoding lists coding (or *) with a non-zero q value
+    bool acceptsEncoding(const char* coding);
+    // q value Accept-Encoding gives coding (or *), 0 if neither is listed
+    float encodingQuality(const char* coding);
+    // q value Accept gives this exact type, 0 if it isn't listed. Wildcards don't count.
+    float acceptQuality(const char* type);
+
     static void freeSession(void* ctx);
     bool hasSessionKey(const char* key);
 #ifdef ARDUINO
@@ -183,6 +199,7 @@ class PsychicRequest
     const char* body(); // returns the body of the request
 #endif
     const char* bodyCStr(); // Always returns const char* regardless of platform — use in library internals.
+    size_t bodyLength();    // bytes in the body, which may hold NULs if it isn't text
     const ContentDisposition getContentDisposition();
     const char* version() { return "HTTP/1.1"; }
 
@@ -3,6 +3,11 @@
 #include <http_status.h>
 #include <strings.h>
 
+#ifdef CONFIG_IDF_TARGET_LINUX
+  #include <errno.h>
+  #include <sys/sendfile.h>
+#endif
+
 PsychicResponse::PsychicResponse(PsychicRequest* request) : _request(request),
                                                             _code(200),
                                                             _status(""),
@@ -18,6 +23,7 @@ PsychicResponse::PsychicResponse(PsychicRequest* request) : _request(request),
 PsychicResponse::~PsychicResponse()
 {
   _headers.clear();
+  delete _deflate;
 }
 
 void PsychicResponse::addHeader(const char* field, const char* value)
@@ -104,15 +110,38 @@ esp_err_t PsychicResponse::send()
 {
   if (!_code)
     setCode(200);
+
+  // gzip the whole body up front, but only use it if it actually came out smaller
+  std::string gz;
+  bool gzipped = false;
+  if (_wantsCompression(getContentLength())) {
+    PsychicDeflate deflate;
+    gz.reserve(getContentLength() / 2);
+    if (deflate.begin([&gz](const uint8_t* data, size_t len) { gz.append((const char*)data, len); return ESP_OK; })) {
+      deflate.write((const uint8_t*)getContent(), getContentLength());
+      deflate.finish();
+      gzipped = gz.size() < getContentLength();
+    }
+  }
+
   // our headers too
   this->sendHeaders();
 
   // now send it off
-  esp_err_t err = httpd_resp_send(_request->request(), getContent(), getContentLength());
+  esp_err_t err;
+  if (gzipped) {
+    httpd_resp_set_hdr(_request->request(), "Content-Encoding", "gzip");
+    err = httpd_resp_send(_request->request(), gz.c_str(), gz.size());
+  } else
+    err = httpd_resp_send(_request->request(), getContent(), getContentLength());
 
   // did something happen?
   if (err != ESP_OK)
     ESP_LOGE(PH_TAG, "Send response failed (%s)", esp_err_to_name(err));
+  else if (_capture) {
+    _capture->append(getContent(), getContentLength());
+    _capture->complete = true;
+  }
 
   return err;
 }
@@ -129,27 +158,223 @@ void PsychicResponse::sendHeaders()
   // now do our individual headers
   for (auto& header : _headers)
     httpd_resp_set_hdr(this->_request->request(), header.field.c_str(), header.value.c_str());
+
+  // a chunked body gets compressed as it streams. these stay out of _headers so a
+  // capture describes the plain body.
+  if (_compressThreshold != SIZE_MAX)
+    httpd_resp_set_hdr(_request->request(), "Vary", "Accept-Encoding");
+  if (_wantsCompression(SIZE_MAX))
+    _beginDeflate();
+  if (_deflate)
+    httpd_resp_set_hdr(_request->request(), "Content-Encoding", "gzip");
+
+  _captureHeaders();
+}
+
+// compression is decided once per response, by whichever send path runs first
+bool PsychicResponse::_wantsCompression(size_t length)
+{
+  if (_compressThreshold == SIZE_MAX || _compressChecked)
+    return false;
+  _compressChecked = true;
+
+  if (length < _compressThreshold || !_request->acceptsEncoding("gzip"))
+    return false;
+
+  // already encoded (e.g. a precompressed file)
+  for (auto& header : _headers)
+    if (strcasecmp(header.field.c_str(), "Content-Encoding") == 0)
+      return false;
+
+  return true;
+}
+
+bool PsychicResponse::_beginDeflate()
+{
+  _deflate = new PsychicDeflate();
+  bool ok = _deflate->begin([this](const uint8_t* data, size_t len) {
+    return httpd_resp_send_chunk(request(), (const char*)data, len);
+  });
+
+  if (!ok) {
+    ESP_LOGE(PH_TAG, "Unable to allocate %zu bytes for gzip, sending uncompressed", PsychicDeflate::memoryUsage());
+    delete _deflate;
+    _deflate = nullptr;
+  }
+
+  return ok;
+}
+
+void PsychicResponse::_captureHeaders()
+{
+  if (_capture) {
+    _capture->code = _code;
+    _capture->contentType = _contentType;
+    _capture->headers = _headers;
+    _capture->body.clear();
+    _capture->overflowed = false;
+  }
 }
 
 esp_err_t PsychicResponse::sendChunk(uint8_t* chunk, size_t chunksize)
 {
   /* Send the buffer contents as HTTP response chunk */
   ESP_LOGD(PH_TAG, "Sending chunk: %d", chunksize);
-  esp_err_t err = httpd_resp_send_chunk(request(), (char*)chunk, chunksize);
+  esp_err_t err = _deflate ? _deflate->write(chunk, chunksize) : httpd_resp_send_chunk(request(), (char*)chunk, chunksize);
   if (err != ESP_OK) {
     ESP_LOGE(PH_TAG, "File sending failed (%s)", esp_err_to_name(err));
 
     /* Abort sending file */
     httpd_resp_sendstr_chunk(this->_request->request(), NULL);
-  }
+  } else if (_capture)
+    _capture->append((const char*)chunk, chunksize);
 
   return err;
 }
 
 esp_err_t PsychicResponse::finishChunking()
 {
+  esp_err_t err = ESP_OK;
+  if (_deflate) {
+    err = _deflate->finish();
+    delete _deflate;
+    _deflate = nullptr;
+    if (err != ESP_OK)
+      return err;
+  }
+
   /* Respond with an empty chunk to signal HTTP response completion */
-  return httpd_resp_send_chunk(this->_request->request(), NULL, 0);
+  err = httpd_resp_send_chunk(this->_request->request(), NULL, 0);
+  if (err == ESP_OK && _capture)
+    _capture->complete = true;
+
+  return err;
+}
+
+// esp-idf only emits a Content-Length from httpd_resp_send(), which needs the whole body in
+// memory. To stream a body of known size we write the head ourselves and send the body raw.
+esp_err_t PsychicResponse::sendHeaders(size_t contentLength)
+{
+  // the compressed size isn't known up front, so a compressed body goes out chunked instead
+  if (_wantsCompression(contentLength) && _beginDeflate()) {
+    _fixedRemaining = contentLength;
+    sendHeaders();
+    return contentLength ? ESP_OK : finishChunking();
+  }
+
+  std::string head;
+  head.reserve(128);
+
+  head += version();
+  head += ' ';
+  head += std::to_string(_code);
+  head += ' ';
+  head += http_status_reason(_code);
+  head += "\r\nContent-Type: ";
+  head += _contentType.empty() ? "text/html" : _contentType.c_str();
+  head += "\r\nContent-Length: ";
+  head += std::to_string(contentLength);
+  head += "\r\n";
+  for (auto& header : _headers) {
+    head += header.field;
+    head += ": ";
+    head += header.value;
+    head += "\r\n";
+  }
+  if (_compressThreshold != SIZE_MAX)
+    head += "Vary: Accept-Encoding\r\n";
+  head += "\r\n";
+
+  _captureHeaders();
+
+  _fixedRemaining = contentLength;
+
+  esp_err_t err = sendRaw(request(), (const uint8_t*)head.c_str(), head.length());
+  if (err == ESP_OK && contentLength == 0 && _capture)
+    _capture->complete = true;
+
+  return err;
+}
+
+esp_err_t PsychicResponse::sendData(const uint8_t* data, size_t len)
+{
+  if (len > _fixedRemaining) {
+    ESP_LOGE(PH_TAG, "Body is longer than the announced Content-Length (%zu > %zu)", len, _fixedRemaining);
+    return ESP_ERR_INVALID_SIZE;
+  }
+
+  esp_err_t err = _deflate ? _deflate->write(data, len) : sendRaw(request(), data, len);
+  if (err != ESP_OK) {
+    ESP_LOGE(PH_TAG, "Data sending failed (%s)", esp_err_to_name(err));
+    return err;
+  }
+
+  _fixedRemaining -= len;
+  if (_capture) {
+    _capture->append((const char*)data, len);
+    if (!_fixedRemaining)
+      _capture->complete = true;
+  }
+
+  if (_deflate && !_fixedRemaining)
+    return finishChunking();
+
+  return ESP_OK;
+}
+
+bool PsychicResponse::canSendFile(int fd)
+{
+#if defined(CONFIG_IDF_TARGET_LINUX) && PSYCHIC_SENDFILE
+  // the bytes have to reach the socket unchanged and unrecorded
+  if (fd < 0 || _compressThreshold != SIZE_MAX || _capture)
+    return false;
+
+  // TLS sessions keep their state in the transport context and must go through httpd_send()
+  return httpd_sess_get_transport_ctx(request()->handle, httpd_req_to_sockfd(request())) == NULL;
+#else
+  // esp_http_server only hands us a socket, and lwIP has no sendfile(): bodies are copied
+  // from a pool buffer into the TCP send buffer by httpd_send()
+  return false;
+#endif
+}
+
+esp_err_t PsychicResponse::sendFile(int fd, size_t offset, size_t len)
+{
+  if (len > _fixedRemaining) {
+    ESP_LOGE(PH_TAG, "Body is longer than the announced Content-Length (%zu > %zu)", len, _fixedRemaining);
+    return ESP_ERR_INVALID_SIZE;
+  }
+
+#ifdef CONFIG_IDF_TARGET_LINUX
+  int sockfd = httpd_req_to_sockfd(request());
+  off_t pos = offset;
+  while (len > 0) {
+    ssize_t sent = sendfile(sockfd, fd, &pos, len);
+    if (sent < 0 && errno == EINTR)
+      continue;
+    if (sent <= 0) {
+      ESP_LOGE(PH_TAG, "sendfile failed (%s)", sent ? strerror(errno) : "file ended early");
+      return ESP_ERR_HTTPD_RESP_SEND;
+    }
+    len -= sent;
+    _fixedRemaining -= sent;
+  }
+  return ESP_OK;
+#else
+  return ESP_ERR_NOT_SUPPORTED;
+#endif
+}
+
+esp_err_t PsychicResponse::sendRaw(httpd_req_t* req, const uint8_t* data, size_t len)
+{
+  while (len > 0) {
+    int sent = httpd_send(req, (const char*)data, len);
+    if (sent < 0)
+      return ESP_ERR_HTTPD_RESP_SEND;
+    data += sent;
+    len -= sent;
+  }
+  return ESP_OK;
 }
 
 esp_err_t PsychicResponse::redirect(const char* url)
@@ -2,10 +2,39 @@
 #define PsychicResponse_h
 
 #include "PsychicCore.h"
+#include "PsychicDeflate.h"
 #include "time.h"
 
 class PsychicRequest;
 
+// set to 0 to send file bodies through a pool buffer on the Linux target too, see canSendFile()
+#ifndef PSYCHIC_SENDFILE
+  #define PSYCHIC_SENDFILE 1
+#endif
+
+// Snapshot of a response as it went out on the wire. Filled in while attached
+// to a response with captureTo() (see CoalescingMiddleware).
+struct PsychicResponseCapture {
+    int code = 0;
+    std::string contentType;
+    std::list<HTTPHeader> headers;
+    std::string body;
+    bool complete = false;
+
+    // stop buffering (and drop what we have) once the body grows past this
+    size_t limit = SIZE_MAX;
+    bool overflowed = false;
+
+    void append(const char* data, size_t len)
+    {
+      if (overflowed || body.size() + len > limit) {
+        overflowed = true;
+        std::string().swap(body);
+      } else
+        body.append(data, len);
+    }
+};
+
 class PsychicResponse
 {
   protected:
@@ -17,6 +46,17 @@ class PsychicResponse
     std::string _contentType;
     int64_t _contentLength;
     const char* _body;
+    PsychicResponseCapture* _capture = nullptr;
+    size_t _fixedRemaining = 0;
+
+    // on-the-fly gzip, see enableCompression()
+    size_t _compressThreshold = SIZE_MAX;
+    bool _compressChecked = false;
+    PsychicDeflate* _deflate = nullptr;
+
+    void _captureHeaders();
+    bool _wantsCompression(size_t length);
+    bool _beginDeflate();
 
   public:
     PsychicResponse(PsychicRequest* request);
@@ -53,6 +93,20 @@ class PsychicResponse
     esp_err_t sendChunk(uint8_t* chunk, size_t chunksize);
     esp_err_t finishChunking();
 
+    // fixed-length streaming: the headers go out with a Content-Length, then exactly
+    // that many body bytes are written raw with sendData() (no chunk framing).
+    esp_err_t sendHeaders(size_t contentLength);
+    esp_err_t sendData(const uint8_t* data, size_t len);
+
+    // Transport hook for file bodies: after sendHeaders(size_t), move len bytes of fd from offset
+    // straight to the socket with sendfile(). Only plain sockets on the Linux target can; ask
+    // canSendFile() before sending headers and use sendData() otherwise.
+    bool canSendFile(int fd);
+    esp_err_t sendFile(int fd, size_t offset, size_t len);
+
+    // write bytes straight to the request's socket, retrying until all of them are out
+    static esp_err_t sendRaw(httpd_req_t* req, const uint8_t* data, size_t len);
+
     esp_err_t redirect(const char* url);
     esp_err_t send(int code);
     esp_err_t send(const char* content);
@@ -62,6 +116,17 @@ class PsychicResponse
     esp_err_t error(httpd_err_code_t code, const char* message);
 
     httpd_req_t* request();
+    PsychicRequest* getRequest() { return _request; }
+
+    // mirror the status, headers and body bytes of this response into capture (nullptr to detach)
+    void captureTo(PsychicResponseCapture* capture) { _capture = capture; }
+
+    // gzip the body on the fly if the client's Accept-Encoding allows it. Bodies with a known
+    // length below threshold go out as they are; chunked bodies are always compressed.
+    void enableCompression(size_t threshold = PSYCHIC_GZIP_THRESHOLD) { _compressThreshold = threshold; }
+    // send the body as it is, e.g. when it is already encoded
+    void disableCompression() { _compressThreshold = SIZE_MAX; }
+    bool isCompressing() { return _deflate != nullptr; }
 };
 
 class PsychicResponseDelegate
@@ -76,6 +141,7 @@ class PsychicResponseDelegate
     const char* version() { return _response->version(); }
 
     void setCode(int code) { _response->setCode(code); }
+    int getCode() { return _response->getCode(); }
 
     void setContentType(const char* contentType) { _response->setContentType(contentType); }
 #ifdef ARDUINO
@@ -103,6 +169,11 @@ class PsychicResponseDelegate
     esp_err_t sendChunk(uint8_t* chunk, size_t chunksize) { return _response->sendChunk(chunk, chunksize); }
     esp_err_t finishChunking() { return _response->finishChunking(); }
 
+    esp_err_t sendHeaders(size_t contentLength) { return _response->sendHeaders(contentLength); }
+    esp_err_t sendData(const uint8_t* data, size_t len) { return _response->sendData(data, len); }
+    bool canSendFile(int fd) { return _response->canSendFile(fd); }
+    esp_err_t sendFile(int fd, size_t offset, size_t len) { return _response->sendFile(fd, offset, len); }
+
     esp_err_t redirect(const char* url) { return _response->redirect(url); }
     esp_err_t send(int code) { return _response->send(code); }
     esp_err_t send(const char* content) { return _response->send(content); }
@@ -112,6 +183,10 @@ class PsychicResponseDelegate
     esp_err_t error(httpd_err_code_t code, const char* message) { return _response->error(code, message); }
 
     httpd_req_t* request() { return _response->request(); }
+    PsychicRequest* getRequest() { return _response->getRequest(); }
+
+    void enableCompression(size_t threshold = PSYCHIC_GZIP_THRESHOLD) { _response->enableCompression(threshold); }
+    void disableCompression() { _response->disableCompression(); }
 };
 
 #endif // PsychicResponse_h
\ No newline at end of file
@@ -1,9 +1,21 @@
 #include "PsychicStaticFileHandler.h"
 
+// precompressed variants we look for, most preferred first
+static const struct {
+    const char* coding;
+    const char* suffix;
+} encodings[] = {{"br", ".br"}, {"gzip", ".gz"}};
+
+// hex digits of the content hash that go into a fingerprinted name
+#define FINGERPRINT_LENGTH 8
+#define IMMUTABLE_CACHE    "public, max-age=31536000, immutable"
+
 /*************************************/
 /*  PsychicStaticFileHandler         */
 /*************************************/
 
+std::atomic<uint32_t> PsychicStaticFileHandler::_generation(0);
+
 void PsychicStaticFileHandler::_initPath()
 {
   // Ensure leading '/'
@@ -24,8 +36,14 @@ void PsychicStaticFileHandler::_initPath()
     _path.pop_back();
 
   // Reset stats
-  _gzipFirst = false;
-  _gzipStats = 0xF8;
+  for (int i = 0; i < ENCODING_COUNT; i++) {
+    _encodingStats[i] = 0xF8;
+    _encodingSkips[i] = 0;
+  }
+  _fingerprinting = false;
+
+  _cacheSize = STATIC_CACHE_SIZE;
+  _cacheLock = xSemaphoreCreateMutex();
 }
 
 #ifdef ARDUINO
@@ -42,6 +60,11 @@ PsychicStaticFileHandler::PsychicStaticFileHandler(const char* uri, const char*
   _initPath();
 }
 
+PsychicStaticFileHandler::~PsychicStaticFileHandler()
+{
+  vSemaphoreDelete(_cacheLock);
+}
+
 PsychicStaticFileHandler* PsychicStaticFileHandler::setIsDir(bool isDir)
 {
   _isDir = isDir;
@@ -73,6 +96,172 @@ PsychicStaticFileHandler* PsychicStaticFileHandler::setLastModified(struct tm* l
   return setLastModified((const char*)result);
 }
 
+PsychicStaticFileHandler* PsychicStaticFileHandler::setTemplateCallback(TemplateCallback cb)
+{
+  _templateCallback = cb;
+  return this;
+}
+
+PsychicStaticFileHandler* PsychicStaticFileHandler::setMetadataCacheSize(size_t entries)
+{
+  xSemaphoreTake(_cacheLock, portMAX_DELAY);
+  _cacheSize = entries;
+  while (_cache.size() > _cacheSize)
+    _cache.pop_back();
+  xSemaphoreGive(_cacheLock);
+  return this;
+}
+
+PsychicStaticFileHandler* PsychicStaticFileHandler::setEtagManifest(const char* filename)
+{
+  // cached ETags came from the old manifest
+  xSemaphoreTake(_cacheLock, portMAX_DELAY);
+  _cache.clear();
+  xSemaphoreGive(_cacheLock);
+
+  _manifest.clear();
+  _manifestPaths.clear();
+  _manifestFile = std::string("/") + (filename[0] == '/' ? filename + 1 : filename);
+
+  psychic::File file = _fs.open((_path + "/" + filename).c_str(), "r");
+  if (!file) {
+    ESP_LOGE(PH_TAG, "ETag manifest %s/%s not found", _path.c_str(), filename);
+    return this;
+  }
+
+  std::string text(file.size(), '\0');
+  text.resize(file.readBytes(&text[0], text.size()));
+  file.close();
+
+  // each line is "<16 hex digits> <path>"
+  size_t pos = 0;
+  while (pos < text.size()) {
+    size_t eol = text.find('\n', pos);
+    if (eol == std::string::npos)
+      eol = text.size();
+    std::string line = text.substr(pos, eol - pos);
+    pos = eol + 1;
+
+    if (!line.empty() && line.back() == '\r')
+      line.pop_back();
+    size_t space = line.find(' ');
+    if (line.empty() || line[0] == '#' || space == std::string::npos || space + 1 >= line.size())
+      continue;
+
+    ManifestEntry entry;
+    entry.path = _manifestPaths.size();
+    entry.hash = strtoull(line.c_str(), nullptr, 16);
+    _manifestPaths.append(line, space + 1, std::string::npos);
+    _manifestPaths.push_back('\0');
+    _manifest.push_back(entry);
+  }
+
+  const char* paths = _manifestPaths.c_str();
+  std::sort(_manifest.begin(), _manifest.end(), [paths](const ManifestEntry& a, const ManifestEntry& b) {
+    return strcmp(paths + a.path, paths + b.path) < 0;
+  });
+  _manifest.shrink_to_fit();
+  _manifestPaths.shrink_to_fit();
+
+  ESP_LOGD(PH_TAG, "Loaded %zu ETags from %s", _manifest.size(), filename);
+
+  return this;
+}
+
+// path is relative to _path and includes the variant suffix
+const PsychicStaticFileHandler::ManifestEntry* PsychicStaticFileHandler::_findManifest(const std::string& path)
+{
+  const char* paths = _manifestPaths.c_str();
+  auto it = std::lower_bound(_manifest.begin(), _manifest.end(), path, [paths](const ManifestEntry& entry, const std::string& key) {
+    return strcmp(paths + entry.path, key.c_str()) < 0;
+  });
+  if (it == _manifest.end() || path != paths + it->path)
+    return nullptr;
+  return &*it;
+}
+
+bool PsychicStaticFileHandler::_findEtag(const std::string& path, std::string& etag)
+{
+  const ManifestEntry* entry = _findManifest(path);
+  if (!entry)
+    return false;
+
+  char buf[20];
+  snprintf(buf, sizeof(buf), "\"%016llx\"", (unsigned long long)entry->hash);
+  etag = buf;
+  return true;
+}
+
+PsychicStaticFileHandler* PsychicStaticFileHandler::setFingerprinting(bool enable)
+{
+  _fingerprinting = enable;
+  return this;
+}
+
+// the plain file's hash, or a variant's if only precompressed copies are on the filesystem
+bool PsychicStaticFileHandler::_fingerprintOf(const std::string& path, uint32_t& fingerprint)
+{
+  const ManifestEntry* entry = _findManifest(path);
+  for (int i = 0; !entry && i < ENCODING_COUNT; i++)
+    entry = _findManifest(path + encodings[i].suffix);
+  if (!entry)
+    return false;
+
+  fingerprint = entry->hash >> (64 - 4 * FINGERPRINT_LENGTH);
+  return true;
+}
+
+// "/js/app.1a2b3c4d.js" -> "/js/app.js" if the manifest knows app.js. the response is only
+// marked immutable if the fingerprint is still current; an old one gets today's file, normally cached.
+bool PsychicStaticFileHandler::_stripFingerprint(std::string& path, bool& immutable)
+{
+  size_t slash = path.rfind('/');
+  size_t ext = path.rfind('.');
+  if (ext == std::string::npos || (slash != std::string::npos && ext < slash) || ext < FINGERPRINT_LENGTH + 2)
+    return false;
+
+  size_t dot = ext - FINGERPRINT_LENGTH - 1;
+  if (path[dot] != '.' || (slash != std::string::npos && dot <= slash + 1))
+    return false;
+  for (size_t i = dot + 1; i < ext; i++)
+    if (!isxdigit((unsigned char)path[i]))
+      return false;
+
+  std::string base = path.substr(0, dot) + path.substr(ext);
+  uint32_t current;
+  if (!_fingerprintOf(base, current))
+    return false;
+
+  immutable = current == strtoul(path.substr(dot + 1, FINGERPRINT_LENGTH).c_str(), nullptr, 16);
+  path = base;
+  return true;
+}
+
+#ifdef ARDUINO
+String PsychicStaticFileHandler::fingerprint(const char* path)
+#else
+std::string PsychicStaticFileHandler::fingerprint(const char* path)
+#endif
+{
+  std::string rel = path[0] == '/' ? path : std::string("/") + path;
+  std::string url = _uri + rel;
+
+  uint32_t hash;
+  size_t slash = rel.rfind('/');
+  size_t ext = rel.rfind('.');
+  if (ext != std::string::npos && ext > slash + 1 && _fingerprintOf(rel, hash)) {
+    char buf[FINGERPRINT_LENGTH + 2];
+    snprintf(buf, sizeof(buf), ".%0*lx", FINGERPRINT_LENGTH, (unsigned long)hash);
+    url = _uri + rel.substr(0, ext) + buf + rel.substr(ext);
+  }
+
+#ifdef ARDUINO
+  return String(url.c_str());
+#else
+  return url;
+#endif
+}
+
 bool PsychicStaticFileHandler::canHandle(PsychicRequest* request)
 {
   if (request->method() != HTTP_GET) {
@@ -85,15 +274,36 @@ bool PsychicStaticFileHandler::canHandle(PsychicRequest* request)
     return false;
   }
 
-  if (_getFile(request)) {
-    return true;
+  // usually answered from the metadata cache. whatever probing opened goes on to handleRequest(),
+  // so the response doesn't open the file again.
+  std::shared_ptr<Probe> probe = std::make_shared<Probe>();
+  if (!_getFile(request, probe->info, probe->file, probe->immutable)) {
+    ESP_LOGD(PH_TAG, "Request %s refused by PsychicStaticFileHandler: file not found", request->uriCStr());
+    request->takeHandlerState(this); // drop a probe of ours from an earlier canHandle()
+    return false;
   }
 
-  ESP_LOGD(PH_TAG, "Request %s refused by PsychicStaticFileHandler: file not found", request->uriCStr());
-  return false;
+  request->setHandlerState(this, probe);
+  return true;
 }
 
-bool PsychicStaticFileHandler::_getFile(PsychicRequest* request)
+// the handler's own files that sit in the web root: ETag manifests and template indexes
+bool PsychicStaticFileHandler::_isInternal(const std::string& path)
+{
+  if (!_manifestFile.empty() && path == _manifestFile)
+    return true;
+
+  size_t slash = path.rfind('/');
+  std::string name = path.substr(slash == std::string::npos ? 0 : slash + 1);
+  if (name == ".etags")
+    return true;
+
+  return name.size() > 4 && name.compare(name.size() - 4, 4, ".idx") == 0 && name.find(".tpl.") != std::string::npos;
+}
+
+// Resolve the request to a file. All results are per request: the handler may be serving
+// several requests at once from async workers. file is left open if probing opened it.
+bool PsychicStaticFileHandler::_getFile(PsychicRequest* request, FileInfo& info, psychic::File& file, bool& immutable)
 {
   // Skip past the mounted prefix (_uri) to get the path relative to the mount point.
   // uriCStr() + _uri.size() is pointer arithmetic: it advances the char* past the
@@ -115,14 +325,47 @@ bool PsychicStaticFileHandler::_getFile(PsychicRequest* request)
   if (path.find("..") != std::string::npos)
     return false;
 
+  immutable = false;
+  if (_fingerprinting)
+    _stripFingerprint(path, immutable);
+
+  if (_isInternal(path))
+    return false;
+
   // We can skip the file check and look for default if request is to the root
   // of a directory or that request path ends with '/'
   bool canSkipFileCheck = (_isDir && path.empty()) || (!path.empty() && path.back() == '/');
 
   path = _path + path;
 
-  // Do we have a file or .gz file
-  if (!canSkipFileCheck && _fileExists(path))
+  // which variants may we send? no Accept-Encoding at all means any coding is fine,
+  // but only gzip is safe to assume.
+  float quality[ENCODING_COUNT + 1];
+  bool anyCoding = !request->hasHeader("Accept-Encoding");
+  for (int i = 0; i < ENCODING_COUNT; i++)
+    quality[i] = anyCoding ? (strcmp(encodings[i].coding, "gzip") == 0 ? 1 : 0) : request->encodingQuality(encodings[i].coding);
+  quality[ENCODING_COUNT] = anyCoding ? 0 : request->encodingQuality("identity");
+
+  // probe order, highest q first: accepted codings (br wins ties), and the plain file,
+  // which is always tried but only goes before a coding the client explicitly ranks lower.
+  // packed two bits per variant (variant + 1), first probe in the low bits.
+  uint8_t order = 0;
+  int shift = 0;
+  bool used[ENCODING_COUNT + 1] = {};
+  for (int n = 0; n <= ENCODING_COUNT; n++) {
+    int best = -1;
+    for (int i = 0; i <= ENCODING_COUNT; i++)
+      if (!used[i] && (quality[i] > 0 || i == ENCODING_COUNT) && (best < 0 || quality[i] > quality[best]))
+        best = i;
+    if (best < 0)
+      break;
+    used[best] = true;
+    order |= (best + 1) << shift;
+    shift += 2;
+  }
+
+  // Do we have a file or a precompressed variant
+  if (!canSkipFileCheck && _fileExists(path, order, info, file))
     return true;
 
   // Can't handle if not default file
@@ -134,98 +377,244 @@ bool PsychicStaticFileHandler::_getFile(PsychicRequest* request)
     path += '/';
   path += _default_file;
 
-  return _fileExists(path);
+  return _fileExists(path, order, info, file);
 }
 
-bool PsychicStaticFileHandler::_fileExists(const std::string& path)
+bool PsychicStaticFileHandler::_fileExists(const std::string& path, uint8_t order, FileInfo& info, psychic::File& file)
 {
-  bool fileFound = false;
-  bool gzipFound = false;
-
-  std::string gzip = path + ".gz";
-
-  if (_gzipFirst) {
-    _file = _fs.open(gzip.c_str(), "r");
-    gzipFound = (bool)_file;
-    if (!gzipFound) {
-      _file = _fs.open(path.c_str(), "r");
-      fileFound = (bool)_file;
-    }
-  } else {
-    _file = _fs.open(path.c_str(), "r");
-    fileFound = (bool)_file;
-    if (!fileFound) {
-      _file = _fs.open(gzip.c_str(), "r");
-      gzipFound = (bool)_file;
+  // read once: an invalidateCache() while we probe must not stamp the old result as current
+  uint32_t generation = _generation;
+
+  // seen it recently? then we don't need to touch the filesystem at all
+  bool cached = false;
+  uint8_t missing = 0;
+  uint8_t skip = 0;
+  xSemaphoreTake(_cacheLock, portMAX_DELAY);
+  for (int i = 0; i < ENCODING_COUNT; i++)
+    if (_encodingStats[i] == 0x00)
+      missing |= 1 << i;
+  for (auto it = _cache.begin(); it != _cache.end(); it++) {
+    if (it->generation == generation && it->order == order && it->path == path) {
+      // skipped a variant that has been turning up since? look again
+      if (it->skipped & ~missing) {
+        _cache.erase(it);
+        break;
+      }
+      _cache.splice(_cache.begin(), _cache, it);
+      info = _cache.front();
+      cached = true;
+      break;
     }
   }
+  // variants missing the last 8 times are skipped, except on every 8th lookup in case they appear
+  for (int i = 0; i < ENCODING_COUNT && !cached; i++)
+    if ((missing & 1 << i) && ++_encodingSkips[i] % 8)
+      skip |= 1 << i;
+  xSemaphoreGive(_cacheLock);
+
+  if (!cached) {
+    int found = -1;
+    uint8_t probed = 0;
+    uint8_t skipped = 0;
+
+    // the client's favourite first, the first one that exists wins
+    for (uint8_t next = order; next && found < 0; next >>= 2) {
+      int variant = (next & 3) - 1;
+      if (variant < ENCODING_COUNT) {
+        if (skip & 1 << variant) {
+          skipped |= 1 << variant;
+          continue;
+        }
+        probed |= 1 << variant;
+      }
+      if ((file = _openVariant(path, variant)))
+        found = variant;
+    }
 
-  bool found = fileFound || gzipFound;
-
-  if (found) {
-    _filename = path;
-
-    // Calculate gzip statistic
-    _gzipStats = (_gzipStats << 1) + (gzipFound ? 1 : 0);
-    if (_gzipStats == 0x00)
-      _gzipFirst = false; // All files are not gzip
-    else if (_gzipStats == 0xFF)
-      _gzipFirst = true; // All files are gzip
-    else
-      _gzipFirst = _countBits(_gzipStats) > 4; // IF we have more gzip files — try gzip first
+    info.path = path;
+    info.order = order;
+    info.skipped = skipped;
+    info.generation = generation;
+    info.variant = found;
+    _describe(info, file);
+
+    xSemaphoreTake(_cacheLock, portMAX_DELAY);
+    // Calculate variant statistics
+    for (int i = 0; i < ENCODING_COUNT; i++)
+      if (probed & 1 << i)
+        _encodingStats[i] = (_encodingStats[i] << 1) + (found == i ? 1 : 0);
+
+    // misses are remembered too, so a missing file (or default file) isn't probed over and over
+    if (_cacheSize) {
+      _cache.push_front(info);
+      while (_cache.size() > _cacheSize)
+        _cache.pop_back();
+    }
+    xSemaphoreGive(_cacheLock);
   }
 
-  ESP_LOGD(PH_TAG, "PsychicStaticFileHandler _fileExists(%s): %d", path.c_str(), found);
+  bool found = info.variant >= 0;
+
+  ESP_LOGD(PH_TAG, "PsychicStaticFileHandler _fileExists(%s): %d%s", path.c_str(), found, cached ? " (cached)" : "");
 
   return found;
 }
 
-uint8_t PsychicStaticFileHandler::_countBits(const uint8_t value) const
+// size, mtime and ETag of the variant that was found
+void PsychicStaticFileHandler::_describe(FileInfo& info, const psychic::File& file)
 {
-  uint8_t w = value;
-  uint8_t n;
-  for (n = 0; w != 0; n++)
-    w &= w - 1;
-  return n;
+  info.size = 0;
+  info.mtime = 0;
+  info.etag.clear();
+  info.strongEtag = false;
+  if (info.variant < 0)
+    return;
+
+  info.size = file.size();
+  info.mtime = file.getLastWrite();
+
+  // a manifest hash if we have one for this exact file, otherwise the size
+  std::string variant = info.path.substr(_path.size());
+  if (info.variant < ENCODING_COUNT)
+    variant += encodings[info.variant].suffix;
+  info.strongEtag = _findEtag(variant, info.etag);
+  if (!info.strongEtag)
+    info.etag = std::to_string(info.size);
+}
+
+// variant ENCODING_COUNT is the plain file
+psychic::File PsychicStaticFileHandler::_openVariant(const std::string& path, int variant)
+{
+  if (variant < ENCODING_COUNT)
+    return _fs.open((path + encodings[variant].suffix).c_str(), "r");
+  return _fs.open(path.c_str(), "r");
 }
 
 esp_err_t PsychicStaticFileHandler::handleRequest(PsychicRequest* request, PsychicResponse* res)
 {
-  if (_file) {
-    // is it not modified?
-    std::string etag = std::to_string(_file.size());
-    if (_last_modified.length() && _last_modified == request->headerCStr("If-Modified-Since")) {
-      _file.close();
-      res->send(304); // Not modified
-    }
-    // does our Etag match?
-    else if (_cache_control.length() && request->hasHeader("If-None-Match") && etag == request->headerCStr("If-None-Match")) {
-      _file.close();
-
-      res->addHeader("Cache-Control", _cache_control.c_str());
-      res->addHeader("ETag", etag.c_str());
-      res->setCode(304);
-      res->send();
+  // set by our canHandle() just before, unless we are called directly
+  std::shared_ptr<Probe> probe = std::static_pointer_cast<Probe>(request->takeHandlerState(this));
+  if (!probe) {
+    probe = std::make_shared<Probe>();
+    if (!_getFile(request, probe->info, probe->file, probe->immutable)) {
+      ESP_LOGD(PH_TAG, "Request %s refused by PsychicStaticFileHandler: file not found", request->uriCStr());
+      return HTTPD_404_NOT_FOUND;
     }
-    // nope, send them the full file.
-    else {
-      // PsychicFileResponse reopens the file from _fs/_filename, so release our
-      // own handle first to avoid holding two descriptors per served file.
-      _file.close();
-      PsychicFileResponse response(res, _fs, _filename.c_str());
-
-      if (_last_modified.length())
-        response.addHeader("Last-Modified", _last_modified.c_str());
-      if (_cache_control.length()) {
-        response.addHeader("Cache-Control", _cache_control.c_str());
-        response.addHeader("ETag", etag.c_str());
-      }
+  }
+
+  FileInfo& info = probe->info;
+  psychic::File& file = probe->file;
+  bool immutable = probe->immutable;
+
+  // rendered per request, so none of the validators below apply
+  if (_templateCallback) {
+    size_t slash = info.path.rfind('/');
+    if (info.path.find(".tpl.", slash == std::string::npos ? 0 : slash) != std::string::npos)
+      return _sendTemplate(res, info.path);
+  }
+
+  std::string& etag = info.etag;
+  // a current fingerprinted name never changes content, so browsers need not ask again
+  std::string cacheControl = immutable ? IMMUTABLE_CACHE : _cache_control;
+  bool sendEtag = info.strongEtag || cacheControl.length();
+
+  // fall back to the file's own timestamp, if the filesystem keeps a sensible one
+  std::string lastModified = _last_modified;
+  if (lastModified.empty() && info.mtime > 1700000000) {
+    char buf[30];
+    strftime(buf, sizeof(buf), "%a, %d %b %Y %H:%M:%S GMT", gmtime(&info.mtime));
+    lastModified = buf;
+  }
+
+  // the body depends on Accept-Encoding whenever variants are probed
+  res->addHeader("Vary", "Accept-Encoding");
+
+  // is it not modified?
+  if (lastModified.length() && lastModified == request->headerCStr("If-Modified-Since"))
+    return res->send(304); // Not modified
+
+  // does our Etag match?
+  if (sendEtag && request->hasHeader("If-None-Match") && etagMatches(request->headerCStr("If-None-Match"), etag.c_str())) {
+    if (cacheControl.length())
+      res->addHeader("Cache-Control", cacheControl.c_str());
+    res->addHeader("ETag", etag.c_str());
+    res->setCode(304);
+    return res->send();
+  }
+
+  // nope, send them the full file. a cache hit hasn't opened it yet.
+  if (!file)
+    file = _openVariant(info.path, info.variant);
+  if (!file) {
+    ESP_LOGE(PH_TAG, "%s disappeared, call PsychicStaticFileHandler::invalidateCache() after changing files", info.path.c_str());
+    return res->send(404);
+  }
+
+  const char* encoding = info.variant < ENCODING_COUNT ? encodings[info.variant].coding : nullptr;
+  PsychicFileResponse response(res, std::move(file), info.path.c_str(), nullptr, false, encoding);
 
-      return response.send();
+  if (lastModified.length())
+    response.addHeader("Last-Modified", lastModified.c_str());
+  if (cacheControl.length())
+    response.addHeader("Cache-Control", cacheControl.c_str());
+  if (sendEtag)
+    response.addHeader("ETag", etag.c_str());
+
+  return response.send();
+}
+
+// the cached index of a template, or a new one if the file changed since
+std::shared_ptr<const PsychicTemplateIndex> PsychicStaticFileHandler::_templateIndex(const std::string& path, const psychic::File& file)
+{
+  std::shared_ptr<const PsychicTemplateIndex> index;
+
+  xSemaphoreTake(_cacheLock, portMAX_DELAY);
+  for (auto it = _templates.begin(); it != _templates.end(); it++) {
+    if ((*it)->path == path) {
+      if ((*it)->size == file.size() && (*it)->mtime == file.getLastWrite()) {
+        index = *it;
+        _templates.splice(_templates.begin(), _templates, it);
+      } else
+        _templates.erase(it);
+      break;
     }
-  } else {
+  }
+  xSemaphoreGive(_cacheLock);
+
+  if (index)
+    return index;
+
+  // scanned outside the lock, two requests for a new file may both do it once
+  index = PsychicTemplateIndex::open(_fs, path.c_str());
+  if (!index)
+    return nullptr;
+
+  xSemaphoreTake(_cacheLock, portMAX_DELAY);
+  _templates.push_front(index);
+  while (_templates.size() > STATIC_TEMPLATE_CACHE_SIZE)
+    _templates.pop_back();
+  xSemaphoreGive(_cacheLock);
+
+  return index;
+}
+
+esp_err_t PsychicStaticFileHandler::_sendTemplate(PsychicResponse* res, const std::string& path)
+{
+  // precompressed copies can't be filled in, only the plain file is rendered
+  psychic::File file = _openVariant(path, ENCODING_COUNT);
+  std::shared_ptr<const PsychicTemplateIndex> index = file ? _templateIndex(path, file) : nullptr;
+  if (!index)
     return res->send(404);
+
+  PsychicTemplateFileResponse response(res, std::move(file), index, _templateCallback, PsychicFileResponse::contentTypeFor(path.c_str()));
+  esp_err_t err = response.send();
+
+  // edited without changing size or mtime, scan it again next time
+  if (response.isStale()) {
+    xSemaphoreTake(_cacheLock, portMAX_DELAY);
+    _templates.remove(index);
+    xSemaphoreGive(_cacheLock);
   }
 
-  return ESP_OK;
+  return err;
 }
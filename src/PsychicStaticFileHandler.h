@@ -6,28 +6,97 @@
 #include "PsychicFileResponse.h"
 #include "PsychicRequest.h"
 #include "PsychicResponse.h"
+#include "PsychicTemplate.h"
 #include "PsychicWebHandler.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include <atomic>
+#include <vector>
+
+// how many resolved paths PsychicStaticFileHandler remembers (existence, variant, size, ETag)
+#ifndef STATIC_CACHE_SIZE
+  #define STATIC_CACHE_SIZE 16
+#endif
+
+// how many template indexes PsychicStaticFileHandler keeps, see setTemplateCallback()
+#ifndef STATIC_TEMPLATE_CACHE_SIZE
+  #define STATIC_TEMPLATE_CACHE_SIZE 4
+#endif
 
 class PsychicStaticFileHandler : public PsychicWebHandler
 {
   private:
     void _initPath();
-    bool _getFile(PsychicRequest* request);
-    bool _fileExists(const std::string& path);
-    uint8_t _countBits(const uint8_t value) const;
+    psychic::File _openVariant(const std::string& path, int variant);
+    bool _findEtag(const std::string& path, std::string& etag);
+    bool _fingerprintOf(const std::string& path, uint32_t& fingerprint);
+    bool _stripFingerprint(std::string& path, bool& immutable);
+    bool _isInternal(const std::string& path);
 
   protected:
     psychic::FS _fs;
-    psychic::File _file;
-    std::string _filename;
     std::string _uri;
     std::string _path;
     std::string _default_file;
     std::string _cache_control;
     std::string _last_modified;
     bool _isDir;
-    bool _gzipFirst;
-    uint8_t _gzipStats;
+
+    // precompressed variants (.br, .gz), probed in the client's order of preference.
+    // the stats remember whether each of the last 8 probes found the variant; one that
+    // was missing every time is only probed on every 8th lookup.
+    static const int ENCODING_COUNT = 2;
+    uint8_t _encodingStats[ENCODING_COUNT];
+    uint8_t _encodingSkips[ENCODING_COUNT];
+
+    // strong ETags from a build-time manifest (tools/etag_manifest.py), sorted by path
+    struct ManifestEntry {
+        uint32_t path; // offset into _manifestPaths
+        uint64_t hash;
+    };
+    std::vector<ManifestEntry> _manifest;
+    std::string _manifestPaths;
+    std::string _manifestFile; // "/<filename>", never served
+    const ManifestEntry* _findManifest(const std::string& path);
+
+    // app.<hash>.js names, see setFingerprinting()
+    bool _fingerprinting;
+
+    // what probing one resolved path found
+    struct FileInfo {
+        std::string path;
+        uint8_t order;     // the variants to probe, see _getFile()
+        uint8_t skipped;   // encodings that weren't probed because they are usually missing, one bit each
+        uint32_t generation;
+        int variant;       // index into the encodings, ENCODING_COUNT for the plain file, -1 if missing
+        size_t size;
+        time_t mtime;
+        std::string etag;
+        bool strongEtag;
+    };
+
+    // a resolved request, handed from canHandle() to handleRequest() with the probed file still open
+    struct Probe {
+        FileInfo info;
+        psychic::File file;
+        bool immutable;
+    };
+
+    bool _getFile(PsychicRequest* request, FileInfo& info, psychic::File& file, bool& immutable);
+    bool _fileExists(const std::string& path, uint8_t order, FileInfo& info, psychic::File& file);
+
+    // bounded LRU of FileInfo so repeat requests skip the filesystem, most recent first
+    std::list<FileInfo> _cache;
+    size_t _cacheSize;
+    SemaphoreHandle_t _cacheLock;
+    static std::atomic<uint32_t> _generation;
+    void _describe(FileInfo& info, const psychic::File& file);
+
+    // *.tpl.* files are rendered through TemplateCallback, their indexes are kept most recent first
+    TemplateCallback _templateCallback;
+    std::list<std::shared_ptr<const PsychicTemplateIndex>> _templates;
+    std::shared_ptr<const PsychicTemplateIndex> _templateIndex(const std::string& path, const psychic::File& file);
+    esp_err_t _sendTemplate(PsychicResponse* response, const std::string& path);
 
   public:
 #ifdef ARDUINO
@@ -36,6 +105,7 @@ class PsychicStaticFileHandler : public PsychicWebHandler
     // IDF / POSIX-VFS constructor — path must be an absolute VFS mount path
     // (e.g. "/littlefs/www"). Users must register the VFS partition before calling.
     PsychicStaticFileHandler(const char* uri, const char* path, const char* cache_control);
+    ~PsychicStaticFileHandler();
     bool canHandle(PsychicRequest* request) override;
     esp_err_t handleRequest(PsychicRequest* request, PsychicResponse* response) override;
     PsychicStaticFileHandler* setIsDir(bool isDir);
@@ -43,6 +113,35 @@ class PsychicStaticFileHandler : public PsychicWebHandler
     PsychicStaticFileHandler* setCacheControl(const char* cache_control);
     PsychicStaticFileHandler* setLastModified(const char* last_modified);
     PsychicStaticFileHandler* setLastModified(struct tm* last_modified);
+
+    // load "<hash> <path>" lines (paths relative to this handler's directory) written by
+    // tools/etag_manifest.py. Listed files get the hash as a strong ETag. Call it again after
+    // updating the filesystem. The manifest itself, like any .etags file and the .idx files of
+    // templates, is never served.
+    PsychicStaticFileHandler* setEtagManifest(const char* filename = ".etags");
+
+    // also answer app.<hash>.js for app.js, where hash is the first 8 digits of its manifest hash.
+    // those responses are cached by browsers forever, so link to them with fingerprint().
+    PsychicStaticFileHandler* setFingerprinting(bool enable = true);
+
+    // render files named like settings.tpl.html with cb, as TemplatePrinter would. Each file is
+    // scanned for placeholders once (or has a .idx from tools/template_index.py) and is then sent
+    // in large slices, with no ETag and Cache-Control: no-cache.
+    PsychicStaticFileHandler* setTemplateCallback(TemplateCallback cb);
+
+    // remember up to entries probed paths (0 turns the cache off)
+    PsychicStaticFileHandler* setMetadataCacheSize(size_t entries);
+
+    // forget cached file metadata in every static handler, e.g. after an upload changed the filesystem
+    static void invalidateCache() { _generation++; }
+
+    // public URL of a file in this handler's directory, fingerprinted if the manifest knows it.
+    // e.g. fingerprint("/js/app.js") -> "/static/js/app.1a2b3c4d.js"
+#ifdef ARDUINO
+    String fingerprint(const char* path);
+#else
+    std::string fingerprint(const char* path);
+#endif
 };
 
 #endif /* PsychicHttp_h */
\ No newline at end of file
@@ -78,12 +78,32 @@ esp_err_t PsychicStreamResponse::endSend()
   return err;
 }
 
+void PsychicStreamResponse::abort()
+{
+  if (!_buffer)
+    return;
+
+  _printer->discard();
+  delete _printer;
+  _printer = NULL;
+  free(_buffer);
+  _buffer = NULL;
+
+  httpd_sess_trigger_close(request()->handle, httpd_req_to_sockfd(request()));
+}
+
 void PsychicStreamResponse::flush()
 {
   if (_buffer)
     _printer->flush();
 }
 
+void PsychicStreamResponse::setFlushPolicy(size_t minSize, uint32_t intervalMs)
+{
+  if (_buffer)
+    _printer->setFlushPolicy(minSize, intervalMs);
+}
+
 size_t PsychicStreamResponse::write(uint8_t data)
 {
   return _buffer ? _printer->write(data) : 0;
@@ -94,6 +114,17 @@ size_t PsychicStreamResponse::write(const uint8_t* buffer, size_t size)
   return _buffer ? _printer->write(buffer, size) : 0;
 }
 
+uint8_t* PsychicStreamResponse::reserve(size_t len)
+{
+  return _buffer ? _printer->reserve(len) : nullptr;
+}
+
+void PsychicStreamResponse::commit(size_t used)
+{
+  if (_buffer)
+    _printer->commit(used);
+}
+
 #ifdef ARDUINO
 size_t PsychicStreamResponse::copyFrom(Stream& stream)
 {
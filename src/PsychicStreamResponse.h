@@ -26,12 +26,20 @@ class PsychicStreamResponse : public PsychicResponseDelegate, public Print
 
     esp_err_t beginSend();
     esp_err_t endSend();
+    // give up on a body that is partly sent: no terminating chunk, and the connection is closed
+    // so the client can't take what it got for the whole response
+    void abort();
 
     void flush() override;
+    void setFlushPolicy(size_t minSize, uint32_t intervalMs);
 
     size_t write(uint8_t data) override;
     size_t write(const uint8_t* buffer, size_t size) override;
 
+    // format straight into the chunk buffer, see ChunkPrinter::reserve()
+    uint8_t* reserve(size_t len);
+    void commit(size_t used);
+
 #ifdef ARDUINO
     size_t copyFrom(Stream& stream);
 #endif
@@ -0,0 +1,468 @@
+#include "PsychicTemplate.h"
+#include "PsychicStreamResponse.h"
+#include "freertos/task.h"
+#include <cctype>
+
+PsychicTemplate::PsychicTemplate(char delimiter) : _delimiter(delimiter),
+                                                   _text(nullptr),
+                                                   _textSize(0),
+                                                   _dirty(true),
+                                                   _lastCheck(0)
+{
+  _lock = xSemaphoreCreateMutex();
+}
+
+PsychicTemplate::~PsychicTemplate()
+{
+  vSemaphoreDelete(_lock);
+}
+
+PsychicTemplate* PsychicTemplate::setText(const char* text, size_t size)
+{
+  xSemaphoreTake(_lock, portMAX_DELAY);
+  _text = text;
+  _textSize = size ? size : strlen(text);
+  _path.clear();
+  _dirty = true;
+  xSemaphoreGive(_lock);
+  return this;
+}
+
+#ifdef ARDUINO
+PsychicTemplate* PsychicTemplate::setFile(fs::FS& fs, const char* path)
+{
+  xSemaphoreTake(_lock, portMAX_DELAY);
+  _fs = psychic::FS(fs);
+  _path = path;
+  _text = nullptr;
+  _dirty = true;
+  xSemaphoreGive(_lock);
+  return this;
+}
+#else
+PsychicTemplate* PsychicTemplate::setFile(const char* path)
+{
+  xSemaphoreTake(_lock, portMAX_DELAY);
+  _path = path;
+  _text = nullptr;
+  _dirty = true;
+  xSemaphoreGive(_lock);
+  return this;
+}
+#endif
+
+PsychicTemplate* PsychicTemplate::setParams(std::initializer_list<const char*> params)
+{
+  xSemaphoreTake(_lock, portMAX_DELAY);
+  _params.assign(params.begin(), params.end());
+  _callbacks.assign(_params.size(), nullptr);
+  _dirty = true;
+  xSemaphoreGive(_lock);
+  return this;
+}
+
+PsychicTemplate* PsychicTemplate::on(const char* param, PsychicTemplateParamCallback fn)
+{
+  xSemaphoreTake(_lock, portMAX_DELAY);
+  int id = _find(param, strlen(param));
+  if (id < 0) {
+    id = _params.size();
+    _params.push_back(param);
+    _callbacks.resize(_params.size());
+  }
+  _callbacks[id] = fn;
+  _dirty = true;
+  xSemaphoreGive(_lock);
+  return this;
+}
+
+// called locked
+int PsychicTemplate::_find(const char* name, size_t len)
+{
+  for (size_t i = 0; i < _params.size(); i++) {
+    if (_params[i].length() == len && memcmp(_params[i].data(), name, len) == 0)
+      return i;
+  }
+  return -1;
+}
+
+int PsychicTemplate::param(const char* name)
+{
+  xSemaphoreTake(_lock, portMAX_DELAY);
+  int id = _find(name, strlen(name));
+  xSemaphoreGive(_lock);
+  return id;
+}
+
+size_t psychicTemplateScan(const char* text, size_t size, char delimiter, bool more, const std::function<void(size_t start, size_t length)>& found)
+{
+  size_t pos = 0;
+
+  while (pos < size) {
+    const char* delim = (const char*)memchr(text + pos, delimiter, size - pos);
+    if (!delim)
+      return size;
+
+    size_t start = delim - text;
+    size_t end = start + 1;
+    while (end < size && end - start <= 63 && (isalnum((uint8_t)text[end]) || text[end] == '_'))
+      end++;
+
+    // a name that runs into the end of the block may still be closed in the next one
+    if (end >= size)
+      return more && end - start <= 64 ? start : size;
+
+    // anything but %NAME% is text. a closing delimiter doesn't open the next placeholder
+    if (text[end] != delimiter) {
+      pos = end;
+      continue;
+    }
+    pos = end + 1;
+    if (end > start + 1)
+      found(start, pos - start);
+  }
+
+  return size;
+}
+
+// Split the text into literal spans and the listed placeholders. Called locked.
+void PsychicTemplate::_compile(Compiled& compiled)
+{
+  const char* text = compiled.text;
+  size_t literal = 0;
+
+  compiled.segments.clear();
+  compiled.callbacks = _callbacks;
+
+  psychicTemplateScan(text, compiled.size, _delimiter, false, [&](size_t start, size_t length) {
+    int id = _find(text + start + 1, length - 2);
+    if (id < 0)
+      return;
+
+    if (start > literal)
+      compiled.segments.push_back({(uint32_t)literal, (uint32_t)(start - literal), -1});
+    compiled.segments.push_back({(uint32_t)start, (uint32_t)length, id});
+    literal = start + length;
+  });
+
+  if (compiled.size > literal)
+    compiled.segments.push_back({(uint32_t)literal, (uint32_t)(compiled.size - literal), -1});
+}
+
+// read the file into compiled. Called locked.
+bool PsychicTemplate::_load(Compiled& compiled)
+{
+  psychic::File file = _fs.open(_path.c_str());
+  if (!file) {
+    ESP_LOGE(PH_TAG, "Template %s not found", _path.c_str());
+    return false;
+  }
+
+  compiled.contents.resize(file.size());
+  size_t read = compiled.contents.empty() ? 0 : file.readBytes(&compiled.contents[0], compiled.contents.size());
+  if (read != compiled.contents.size()) {
+    ESP_LOGE(PH_TAG, "Template %s: short read", _path.c_str());
+    return false;
+  }
+
+  compiled.text = compiled.contents.data();
+  compiled.size = compiled.contents.size();
+  compiled.mtime = file.getLastWrite();
+  return true;
+}
+
+// a file template whose size or modification time moved on. Called locked.
+bool PsychicTemplate::_changed()
+{
+  if (_path.empty() || !_compiled)
+    return false;
+
+  // a stat per request would cost more than the parse saves
+  TickType_t now = xTaskGetTickCount();
+  if ((TickType_t)(now - _lastCheck) < pdMS_TO_TICKS(PSYCHIC_TEMPLATE_CHECK_MS))
+    return false;
+  _lastCheck = now;
+
+  psychic::File file = _fs.open(_path.c_str());
+  return !file || file.size() != _compiled->size || file.getLastWrite() != _compiled->mtime;
+}
+
+std::shared_ptr<const PsychicTemplate::Compiled> PsychicTemplate::_current()
+{
+  xSemaphoreTake(_lock, portMAX_DELAY);
+  if (_dirty || _changed()) {
+    std::shared_ptr<Compiled> compiled = std::make_shared<Compiled>();
+    bool ok = true;
+    if (_path.empty()) {
+      compiled->text = _text ? _text : "";
+      compiled->size = _text ? _textSize : 0;
+      compiled->mtime = 0;
+    } else
+      ok = _load(*compiled);
+
+    if (ok) {
+      _compile(*compiled);
+      _compiled = compiled;
+      _lastCheck = xTaskGetTickCount();
+    } else
+      _compiled = nullptr;
+    _dirty = !ok;
+  }
+
+  // renders already under way keep the version they started with
+  std::shared_ptr<const Compiled> current = _compiled;
+  xSemaphoreGive(_lock);
+  return current;
+}
+
+bool PsychicTemplate::compile()
+{
+  return _current() != nullptr;
+}
+
+esp_err_t PsychicTemplate::render(Print& output, PsychicTemplateCallback cb)
+{
+  std::shared_ptr<const Compiled> compiled = _current();
+  if (!compiled)
+    return ESP_ERR_NOT_FOUND;
+
+  const std::vector<PsychicTemplateParamCallback>& callbacks = compiled->callbacks;
+  for (const Segment& segment : compiled->segments) {
+    const uint8_t* data = (const uint8_t*)compiled->text + segment.offset;
+    if (segment.param >= 0) {
+      if ((size_t)segment.param < callbacks.size() && callbacks[segment.param]) {
+        callbacks[segment.param](output);
+        continue;
+      }
+      if (cb && cb(output, segment.param))
+        continue;
+    }
+    output.write(data, segment.length);
+  }
+
+  return ESP_OK;
+}
+
+esp_err_t PsychicTemplate::send(PsychicResponse* response, const char* contentType, PsychicTemplateCallback cb)
+{
+  if (!compile())
+    return response->send(404);
+
+  PsychicStreamResponse stream(response, contentType);
+  esp_err_t err = stream.beginSend();
+  if (err != ESP_OK)
+    return err;
+
+  render(stream, cb);
+  return stream.endSend();
+}
+
+/*************************************/
+/*  PsychicTemplateIndex             */
+/*************************************/
+
+bool PsychicTemplateIndex::build(psychic::File& file, char delimiter)
+{
+  // a placeholder is at most 65 bytes, so the block always holds a whole one
+  char block[512];
+  size_t base = 0;
+  size_t have = 0;
+
+  this->delimiter = delimiter;
+  placeholders.clear();
+  while (true) {
+    size_t got = file.readBytes(block + have, sizeof(block) - have);
+    have += got;
+    bool more = base + have < size;
+    if (more && !got)
+      return false;
+
+    size_t done = psychicTemplateScan(block, have, delimiter, more, [&](size_t start, size_t length) {
+      placeholders.push_back({(uint32_t)(base + start), (uint32_t)length});
+    });
+    if (!more)
+      return true;
+
+    // keep a placeholder that was cut off for the next round
+    memmove(block, block + done, have - done);
+    base += done;
+    have -= done;
+  }
+}
+
+bool PsychicTemplateIndex::parse(const std::string& text, size_t size)
+{
+  bool sized = false;
+  uint32_t next = 0;
+
+  placeholders.clear();
+  size_t pos = 0;
+  while (pos < text.size()) {
+    size_t eol = text.find('\n', pos);
+    if (eol == std::string::npos)
+      eol = text.size();
+    std::string line = text.substr(pos, eol - pos);
+    pos = eol + 1;
+
+    if (line.empty() || line[0] == '#' || line[0] == '\r')
+      continue;
+    if (line.compare(0, 5, "size ") == 0) {
+      sized = strtoul(line.c_str() + 5, nullptr, 10) == size;
+      if (!sized)
+        return false;
+      continue;
+    }
+
+    // "<offset> <length> <name>", in order, within the file and no longer than %NAME% can be
+    char* end;
+    uint32_t offset = strtoul(line.c_str(), &end, 10);
+    uint32_t length = strtoul(end, nullptr, 10);
+    if (offset < next || length < 3 || length > 65 || offset + length > size)
+      return false;
+    placeholders.push_back({offset, length});
+    next = offset + length;
+  }
+
+  return sized;
+}
+
+bool PsychicTemplateIndex::isPlaceholder(const char* raw, size_t length) const
+{
+  if (length < 3 || raw[0] != delimiter || raw[length - 1] != delimiter)
+    return false;
+  for (size_t i = 1; i < length - 1; i++) {
+    if (!isalnum((uint8_t)raw[i]) && raw[i] != '_')
+      return false;
+  }
+  return true;
+}
+
+bool PsychicTemplateIndex::verify(psychic::File& file)
+{
+  char raw[65];
+  for (const Placeholder& placeholder : placeholders) {
+    if (!file.seek(placeholder.offset) || file.readBytes(raw, placeholder.length) != placeholder.length)
+      return false;
+    if (!isPlaceholder(raw, placeholder.length))
+      return false;
+  }
+  return true;
+}
+
+std::shared_ptr<const PsychicTemplateIndex> PsychicTemplateIndex::open(psychic::FS fs, const char* path, char delimiter)
+{
+  psychic::File file = fs.open(path);
+  if (!file)
+    return nullptr;
+
+  std::shared_ptr<PsychicTemplateIndex> index = std::make_shared<PsychicTemplateIndex>();
+  index->path = path;
+  index->size = file.size();
+  index->mtime = file.getLastWrite();
+  index->delimiter = delimiter;
+
+  // from tools/template_index.py, if it was run on this version of the file
+  std::string sidecar = std::string(path) + ".idx";
+  psychic::File idx = fs.open(sidecar.c_str());
+  if (idx) {
+    std::string text(idx.size(), '\0');
+    text.resize(idx.readBytes(&text[0], text.size()));
+    // the size alone doesn't tell an edited file apart, so check every placeholder is still there
+    if (index->parse(text, index->size) && index->verify(file))
+      return index;
+    ESP_LOGE(PH_TAG, "%s doesn't match its template, scanning it instead", sidecar.c_str());
+    if (!file.seek(0))
+      return nullptr;
+  }
+
+  if (!index->build(file, delimiter)) {
+    ESP_LOGE(PH_TAG, "Template %s: short read", path);
+    return nullptr;
+  }
+  return index;
+}
+
+/*************************************/
+/*  PsychicTemplateFileResponse      */
+/*************************************/
+
+PsychicTemplateFileResponse::PsychicTemplateFileResponse(PsychicResponse* response, psychic::File&& file, std::shared_ptr<const PsychicTemplateIndex> index,
+  TemplateCallback cb, const char* contentType) : PsychicResponseDelegate(response),
+                                                  _file(std::move(file)),
+                                                  _index(index),
+                                                  _cb(cb),
+                                                  _contentType(contentType ? contentType : "text/html"),
+                                                  _stale(false)
+{
+}
+
+// read len bytes of the file straight into the chunk buffer
+static esp_err_t copyRange(psychic::File& file, PsychicStreamResponse& stream, size_t len)
+{
+  while (len) {
+    size_t slice = std::min(len, (size_t)STREAM_CHUNK_SIZE);
+    uint8_t* data = stream.reserve(slice);
+    if (!data)
+      return ESP_FAIL;
+    size_t got = file.readBytes((char*)data, slice);
+    stream.commit(got);
+    if (got != slice)
+      return ESP_FAIL;
+    len -= slice;
+  }
+  return ESP_OK;
+}
+
+esp_err_t PsychicTemplateFileResponse::send()
+{
+  if (!_file || !_index)
+    return _response->send(404);
+
+  // rendered on every request, so nothing about it can be cached
+  addHeader("Cache-Control", "no-cache");
+
+  PsychicStreamResponse stream(_response, _contentType.c_str());
+  esp_err_t err = stream.beginSend();
+  if (err != ESP_OK)
+    return err;
+
+  size_t pos = 0;
+  for (const PsychicTemplateIndex::Placeholder& placeholder : _index->placeholders) {
+    err = copyRange(_file, stream, placeholder.offset - pos);
+    if (err != ESP_OK)
+      break;
+
+    char raw[66];
+    if (_file.readBytes(raw, placeholder.length) != placeholder.length) {
+      err = ESP_FAIL;
+      break;
+    }
+    pos = placeholder.offset + placeholder.length;
+
+    // the file changed under the index, don't hand the callback a name that isn't one
+    if (!_index->isPlaceholder(raw, placeholder.length)) {
+      ESP_LOGE(PH_TAG, "Template %s: no placeholder at %u, the index is out of date", _index->path.c_str(), (unsigned)placeholder.offset);
+      stream.write((uint8_t*)raw, placeholder.length);
+      _stale = true;
+      continue;
+    }
+
+    // the name without its delimiters, the callback gets it as TemplatePrinter would pass it
+    raw[placeholder.length - 1] = '\0';
+    if (_cb && _cb(stream, raw + 1))
+      continue;
+    raw[placeholder.length - 1] = raw[0];
+    stream.write((uint8_t*)raw, placeholder.length);
+  }
+
+  if (err == ESP_OK)
+    err = copyRange(_file, stream, _index->size - pos);
+  if (err != ESP_OK) {
+    // the headers are out, so hang up rather than end a truncated body as if it were complete
+    ESP_LOGE(PH_TAG, "Template %s: the file changed or the client went away", _index->path.c_str());
+    stream.abort();
+    return err;
+  }
+
+  return stream.endSend();
+}
@@ -0,0 +1,182 @@
+#ifndef PsychicTemplate_h
+#define PsychicTemplate_h
+
+#include "PsychicCore.h"
+#include "PsychicFS.h"
+#include "PsychicPrint.h"
+#include "PsychicResponse.h"
+#include "TemplatePrinter.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include <initializer_list>
+#include <memory>
+#include <vector>
+
+// how often a file template checks whether the file changed (ms)
+#ifndef PSYCHIC_TEMPLATE_CHECK_MS
+  #define PSYCHIC_TEMPLATE_CHECK_MS 1000
+#endif
+
+// Find placeholders the way TemplatePrinter reads them: a delimiter, 1 to 63 letters, digits or
+// underscores and another delimiter. found() gets the start and length of each, delimiters
+// included. Returns how much of text was scanned: all of it, or with more set (text continues in
+// a next block) up to a placeholder that might be cut off.
+size_t psychicTemplateScan(const char* text, size_t size, char delimiter, bool more, const std::function<void(size_t start, size_t length)>& found);
+
+// fill placeholder param (its index in setParams()), false leaves it as it is
+typedef std::function<bool(Print& output, int param)> PsychicTemplateCallback;
+// fill one placeholder, see PsychicTemplate::on()
+typedef std::function<void(Print& output)> PsychicTemplateParamCallback;
+
+// A template that is parsed once instead of on every request. Compiling splits the text into
+// literal spans and placeholders with an integer ID, so rendering copies whole spans and
+// dispatches placeholders by index. The syntax is TemplatePrinter's: %NAME%, where NAME is up
+// to 63 letters, digits or underscores.
+//
+//   enum { SSID, IP };
+//   PsychicTemplate settings;
+//   settings.setFile(LittleFS, "/settings.html")->setParams({"SSID", "IP"});
+//   ...
+//   return settings.send(response, "text/html", [](Print& output, int param) {
+//     switch (param) {
+//       case SSID: output.print(WiFi.SSID()); return true;
+//       case IP: output.print(WiFi.localIP()); return true;
+//     }
+//     return false;
+//   });
+//
+// Only listed names are placeholders, anything else between delimiters is sent as it is.
+// A file is compiled on first use and again when its size or modification time changes.
+class PsychicTemplate
+{
+  protected:
+    // literal text, or a placeholder whose span includes both delimiters
+    struct Segment {
+        uint32_t offset;
+        uint32_t length;
+        int param; // -1 for literal text
+    };
+
+    struct Compiled {
+        std::string contents; // the file, empty for setText()
+        const char* text;
+        size_t size;
+        std::vector<Segment> segments;
+        std::vector<PsychicTemplateParamCallback> callbacks; // by ID, as they were when compiled
+        time_t mtime;
+    };
+
+    char _delimiter;
+    std::vector<std::string> _params;
+    std::vector<PsychicTemplateParamCallback> _callbacks;
+
+    const char* _text;
+    size_t _textSize;
+    psychic::FS _fs;
+    std::string _path;
+
+    SemaphoreHandle_t _lock;
+    std::shared_ptr<const Compiled> _compiled;
+    bool _dirty;
+    TickType_t _lastCheck;
+
+    int _find(const char* name, size_t len);
+    void _compile(Compiled& compiled);
+    bool _load(Compiled& compiled);
+    bool _changed();
+    std::shared_ptr<const Compiled> _current();
+
+  public:
+    PsychicTemplate(char delimiter = '%');
+    ~PsychicTemplate();
+
+    PsychicTemplate(const PsychicTemplate&) = delete;
+    PsychicTemplate& operator=(const PsychicTemplate&) = delete;
+
+    // a template in memory, e.g. a string literal. It is not copied and must outlive this.
+    PsychicTemplate* setText(const char* text, size_t size = 0);
+
+    // a template file, read into memory when compiled
+#ifdef ARDUINO
+    PsychicTemplate* setFile(fs::FS& fs, const char* path);
+#else
+    PsychicTemplate* setFile(const char* path);
+#endif
+
+    // the placeholder names, a placeholder's ID is its index in this list
+    PsychicTemplate* setParams(std::initializer_list<const char*> params);
+
+    // fill one placeholder with its own callback instead of the render callback. An unlisted
+    // name is added to the end of the list.
+    PsychicTemplate* on(const char* param, PsychicTemplateParamCallback fn);
+
+    // ID of a listed name, -1 if it isn't
+    int param(const char* name);
+
+    // parse now rather than on the first render, false if the file can't be read
+    bool compile();
+
+    esp_err_t render(Print& output, PsychicTemplateCallback cb = nullptr);
+
+    // render into a chunked response, 404 if the file is missing
+    esp_err_t send(PsychicResponse* response, const char* contentType, PsychicTemplateCallback cb = nullptr);
+};
+
+// Where the placeholders of a template file are, so it can be sent in large slices straight from
+// the file with a call out only at these offsets. Built by scanning the file once, or loaded from
+// a "<file>.idx" written by tools/template_index.py:
+//
+//   # comment
+//   size <file size>
+//   <offset> <length> <name>
+struct PsychicTemplateIndex {
+    struct Placeholder {
+        uint32_t offset;
+        uint32_t length; // delimiters included
+    };
+
+    std::string path;
+    size_t size;
+    time_t mtime;
+    char delimiter = '%';
+    std::vector<Placeholder> placeholders;
+
+    // scan file from where it is now, the caller seeks back before rendering
+    bool build(psychic::File& file, char delimiter = '%');
+    // false if text doesn't describe a file of size bytes
+    bool parse(const std::string& text, size_t size);
+    // false if any placeholder isn't a %NAME% in file, e.g. the file was edited without
+    // changing its size. Leaves the file anywhere.
+    bool verify(psychic::File& file);
+    // raw is a whole placeholder, delimiters included
+    bool isPlaceholder(const char* raw, size_t length) const;
+
+    // "<path>.idx" if it matches the file, otherwise scanned from the file. nullptr if there is no file.
+    static std::shared_ptr<const PsychicTemplateIndex> open(psychic::FS fs, const char* path, char delimiter = '%');
+};
+
+// Renders a template file with an index: the text between placeholders is read into the chunk
+// buffer in slices of up to STREAM_CHUNK_SIZE, each placeholder goes to cb by name, and if cb
+// returns false it is sent as it is. PsychicStaticFileHandler::setTemplateCallback() uses this
+// for *.tpl.* files.
+class PsychicTemplateFileResponse : public PsychicResponseDelegate
+{
+  protected:
+    psychic::File _file;
+    std::shared_ptr<const PsychicTemplateIndex> _index;
+    TemplateCallback _cb;
+    std::string _contentType;
+    bool _stale;
+
+  public:
+    // file must be at its start
+    PsychicTemplateFileResponse(PsychicResponse* response, psychic::File&& file, std::shared_ptr<const PsychicTemplateIndex> index,
+      TemplateCallback cb, const char* contentType = "text/html");
+
+    esp_err_t send();
+
+    // the file no longer matched the index while sending, it should be built again
+    bool isStale() const { return _stale; }
+};
+
+#endif // PsychicTemplate_h
@@ -1,4 +1,5 @@
 #include "PsychicUploadHandler.h"
+#include "PsychicHttpServer.h"
 
 PsychicUploadHandler::PsychicUploadHandler() : PsychicWebHandler(), _uploadCallback(nullptr)
 {
@@ -45,7 +46,10 @@ esp_err_t PsychicUploadHandler::handleRequest(PsychicRequest* request, PsychicRe
       err = response->send("Upload Successful.");
   } else if (err == ESP_ERR_HTTPD_INVALID_REQ)
     response->send(400, "text/html", "No multipart boundary found.");
-  else
+  else if (err == ESP_ERR_NO_MEM) {
+    response->addHeader("Retry-After", "1");
+    response->send(503, "text/html", "Server busy, try again.");
+  } else
     response->send(500, "text/html", "Error processing upload.");
 
   return err;
@@ -57,8 +61,11 @@ esp_err_t PsychicUploadHandler::_basicUploadHandler(PsychicRequest* request)
 
   const char* filename = request->getFilenameCStr();
 
-  /* Retrieve the pointer to scratch buffer for temporary storage */
-  char* buf = (char*)malloc(FILE_CHUNK_SIZE);
+  /* Borrow a scratch buffer from the server's pool, any size will do */
+  PsychicPooledBuffer buffer(&request->server()->bufferPool, PSYCHIC_POOL_SMALL_SIZE, FILE_CHUNK_SIZE);
+  if (!buffer)
+    return ESP_ERR_NO_MEM;
+  char* buf = (char*)buffer.data();
   int received;
   unsigned long index = 0;
 
@@ -73,7 +80,7 @@ esp_err_t PsychicUploadHandler::_basicUploadHandler(PsychicRequest* request)
     // ESP_LOGD(PH_TAG, "Remaining size : %d", remaining);
 
     /* Receive the file part by part into a buffer */
-    if ((received = httpd_req_recv(request->request(), buf, std::min(remaining, (int)FILE_CHUNK_SIZE))) <= 0) {
+    if ((received = httpd_req_recv(request->request(), buf, std::min(remaining, (int)buffer.size()))) <= 0) {
       /* Retry if timeout occurred */
       if (received == HTTPD_SOCK_ERR_TIMEOUT)
         continue;
@@ -103,9 +110,6 @@ esp_err_t PsychicUploadHandler::_basicUploadHandler(PsychicRequest* request)
     }
   }
 
-  // dont forget to free our buffer
-  free(buf);
-
   return err;
 }
 
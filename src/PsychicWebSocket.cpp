@@ -1,4 +1,5 @@
 #include "PsychicWebSocket.h"
+#include <deque>
 #ifdef PSYCHIC_WS_RX_STATIC_BUFFER
 #include <freertos/FreeRTOS.h>
 #include <freertos/semphr.h>
@@ -33,8 +34,12 @@ extern "C" void psychic_ws_preinit_rx_buf() {
 /*************************************/
 
 PsychicWebSocketRequest::PsychicWebSocketRequest(PsychicRequest* req) : PsychicRequest(req->server(), req->request()),
-                                                                        _client(req->client())
+                                                                        _client((PsychicWebSocketClient*)req->client()->_friend)
 {
+  if (_client == NULL) {
+    _ownClient.reset(new PsychicWebSocketClient(req->client()));
+    _client = _ownClient.get();
+  }
 }
 
 PsychicWebSocketRequest::~PsychicWebSocketRequest()
@@ -43,7 +48,7 @@ PsychicWebSocketRequest::~PsychicWebSocketRequest()
 
 PsychicWebSocketClient* PsychicWebSocketRequest::client()
 {
-  return &_client;
+  return _client;
 }
 
 esp_err_t PsychicWebSocketRequest::reply(httpd_ws_frame_t* ws_pkt)
@@ -69,35 +74,308 @@ esp_err_t PsychicWebSocketRequest::reply(const char* buf)
 }
 
 /*************************************/
-/*  PsychicWebSocketClient   */
+/*  PsychicWebSocketPayload   */
 /*************************************/
 
-PsychicWebSocketClient::PsychicWebSocketClient(PsychicClient* client)
-    : PsychicClient(client->server(), client->socket())
+PsychicWebSocketPayload::PsychicWebSocketPayload(httpd_ws_type_t op, size_t len) : _refs(1)
 {
+  memset(&_frame, 0, sizeof(httpd_ws_frame_t));
+  _frame.payload = (uint8_t*)(this + 1);
+  _frame.len = len;
+  _frame.type = op;
 }
 
-PsychicWebSocketClient::~PsychicWebSocketClient()
+PsychicWebSocketPayload* PsychicWebSocketPayload::create(httpd_ws_type_t op, const void* data, size_t len)
 {
+  // header and payload in one allocation
+  void* memory = malloc(sizeof(PsychicWebSocketPayload) + len);
+  if (memory == NULL) {
+    ESP_LOGE(PH_TAG, "Websocket: out of memory");
+    return NULL;
+  }
+
+  PsychicWebSocketPayload* payload = new (memory) PsychicWebSocketPayload(op, len);
+  if (len)
+    memcpy(payload->_frame.payload, data, len);
+
+  return payload;
 }
 
-void PsychicWebSocketClient::_sendMessageCallback(esp_err_t err, int socket, void* arg)
+void PsychicWebSocketPayload::retain()
 {
-  // free our frame.
-  httpd_ws_frame_t* ws_pkt = (httpd_ws_frame_t*)arg;
-  free(ws_pkt->payload);
-  free(ws_pkt);
+  _refs.fetch_add(1, std::memory_order_relaxed);
+}
 
-  if (err == ESP_OK)
+void PsychicWebSocketPayload::release()
+{
+  if (_refs.fetch_sub(1, std::memory_order_acq_rel) != 1)
     return;
-  else if (err == ESP_FAIL)
+
+  this->~PsychicWebSocketPayload();
+  free(this);
+}
+
+/*************************************/
+/*  PsychicWebSocketQueue   */
+/*************************************/
+
+// The outgoing messages of one client. The first one is being sent, and its completion callback
+// starts the next, so there is only ever one send per client queued in the server. The send in
+// flight holds a reference, so the queue outlives a client that goes away in the meantime.
+class PsychicWebSocketQueue
+{
+  private:
+    httpd_handle_t _server;
+    int _socket;
+    SemaphoreHandle_t _lock;
+    std::atomic<uint32_t> _refs;
+    std::deque<PsychicWebSocketPayload*> _messages;
+    size_t _bytes;
+    bool _sending;
+    bool _closed;
+    uint32_t _dropped;
+    size_t _maxMessages;
+    size_t _maxBytes;
+    PsychicWebSocketQueuePolicy _policy;
+
+    static void _sendCallback(esp_err_t err, int socket, void* arg);
+    void _sendNext();
+
+  public:
+    PsychicWebSocketQueue(httpd_handle_t server, int socket);
+    ~PsychicWebSocketQueue();
+
+    void retain();
+    void release();
+
+    void setLimits(size_t messages, size_t bytes, PsychicWebSocketQueuePolicy policy);
+    esp_err_t push(PsychicWebSocketPayload* payload);
+    // drop everything that is still waiting, the socket may be reused by another client
+    void close();
+
+    size_t length();
+    size_t bytes();
+    uint32_t dropped();
+};
+
+PsychicWebSocketQueue::PsychicWebSocketQueue(httpd_handle_t server, int socket) : _server(server),
+                                                                                _socket(socket),
+                                                                                _refs(1),
+                                                                                _bytes(0),
+                                                                                _sending(false),
+                                                                                _closed(false),
+                                                                                _dropped(0),
+                                                                                _maxMessages(PSYCHIC_WS_QUEUE_MESSAGES),
+                                                                                _maxBytes(PSYCHIC_WS_QUEUE_BYTES),
+                                                                                _policy(PSYCHIC_WS_QUEUE_POLICY)
+{
+  _lock = xSemaphoreCreateMutex();
+}
+
+PsychicWebSocketQueue::~PsychicWebSocketQueue()
+{
+  for (PsychicWebSocketPayload* payload : _messages)
+    payload->release();
+  vSemaphoreDelete(_lock);
+}
+
+void PsychicWebSocketQueue::retain()
+{
+  _refs.fetch_add(1, std::memory_order_relaxed);
+}
+
+void PsychicWebSocketQueue::release()
+{
+  if (_refs.fetch_sub(1, std::memory_order_acq_rel) == 1)
+    delete this;
+}
+
+void PsychicWebSocketQueue::setLimits(size_t messages, size_t bytes, PsychicWebSocketQueuePolicy policy)
+{
+  xSemaphoreTake(_lock, portMAX_DELAY);
+  _maxMessages = messages;
+  _maxBytes = bytes;
+  _policy = policy;
+  xSemaphoreGive(_lock);
+}
+
+esp_err_t PsychicWebSocketQueue::push(PsychicWebSocketPayload* payload)
+{
+  xSemaphoreTake(_lock, portMAX_DELAY);
+
+  if (_closed) {
+    xSemaphoreGive(_lock);
+    return ESP_FAIL;
+  }
+
+  bool full = !_messages.empty() && (_messages.size() + 1 > _maxMessages || _bytes + payload->length() > _maxBytes);
+  if (full && _policy != WS_QUEUE_DROP_OLDEST) {
+    _dropped++;
+    bool disconnect = _policy == WS_QUEUE_DISCONNECT;
+    xSemaphoreGive(_lock);
+
+    if (disconnect) {
+      ESP_LOGW(PH_TAG, "Websocket: send queue full, closing slow client (#%d)", _socket);
+      httpd_sess_trigger_close(_server, _socket);
+      return ESP_FAIL;
+    }
+    return ESP_ERR_NO_MEM;
+  }
+
+  payload->retain();
+  _messages.push_back(payload);
+  _bytes += payload->length();
+
+  // make room by dropping the oldest waiting messages, never the one being sent or the new one
+  while ((_messages.size() > _maxMessages || _bytes > _maxBytes) && _messages.size() > 2) {
+    PsychicWebSocketPayload* oldest = _messages[1];
+    _messages.erase(_messages.begin() + 1);
+    _bytes -= oldest->length();
+    _dropped++;
+    oldest->release();
+  }
+
+  bool start = !_sending;
+  _sending = true;
+  xSemaphoreGive(_lock);
+
+  if (start)
+    _sendNext();
+
+  return ESP_OK;
+}
+
+// queue the first message with the server, dropping any that can't be. Called unlocked, by
+// whoever set _sending.
+void PsychicWebSocketQueue::_sendNext()
+{
+  while (true) {
+    xSemaphoreTake(_lock, portMAX_DELAY);
+    if (_messages.empty()) {
+      _sending = false;
+      xSemaphoreGive(_lock);
+      return;
+    }
+    PsychicWebSocketPayload* payload = _messages.front();
+    xSemaphoreGive(_lock);
+
+    // the send in flight keeps us around until its callback
+    retain();
+    esp_err_t err = httpd_ws_send_data_async(_server, _socket, payload->frame(), PsychicWebSocketQueue::_sendCallback, this);
+    if (err == ESP_OK)
+      return;
+    release();
+
+    ESP_LOGE(PH_TAG, "Websocket: unable to queue message with %s (#%d)", esp_err_to_name(err), _socket);
+
+    xSemaphoreTake(_lock, portMAX_DELAY);
+    _messages.pop_front();
+    _bytes -= payload->length();
+    _dropped++;
+    xSemaphoreGive(_lock);
+    payload->release();
+  }
+}
+
+void PsychicWebSocketQueue::_sendCallback(esp_err_t err, int socket, void* arg)
+{
+  PsychicWebSocketQueue* queue = (PsychicWebSocketQueue*)arg;
+
+  if (err == ESP_FAIL)
     ESP_LOGE(PH_TAG, "Websocket: send - socket error (#%d)", socket);
   else if (err == ESP_ERR_INVALID_STATE)
     ESP_LOGE(PH_TAG, "Websocket: Handshake was already done beforehand (#%d)", socket);
   else if (err == ESP_ERR_INVALID_ARG)
     ESP_LOGE(PH_TAG, "Websocket: Argument is invalid (null or non-WebSocket) (#%d)", socket);
-  else
+  else if (err != ESP_OK)
     ESP_LOGE(PH_TAG, "Websocket: Send message unknown error. (#%d)", socket);
+
+  // done with the first message, on to the next one
+  xSemaphoreTake(queue->_lock, portMAX_DELAY);
+  PsychicWebSocketPayload* payload = queue->_messages.front();
+  queue->_messages.pop_front();
+  queue->_bytes -= payload->length();
+  if (err != ESP_OK)
+    queue->_dropped++;
+  xSemaphoreGive(queue->_lock);
+  payload->release();
+
+  queue->_sendNext();
+  queue->release();
+}
+
+void PsychicWebSocketQueue::close()
+{
+  xSemaphoreTake(_lock, portMAX_DELAY);
+  _closed = true;
+  // the one being sent is popped by its callback
+  while (_messages.size() > (_sending ? 1 : 0)) {
+    _bytes -= _messages.back()->length();
+    _messages.back()->release();
+    _messages.pop_back();
+  }
+  xSemaphoreGive(_lock);
+}
+
+size_t PsychicWebSocketQueue::length()
+{
+  xSemaphoreTake(_lock, portMAX_DELAY);
+  size_t length = _messages.size();
+  xSemaphoreGive(_lock);
+  return length;
+}
+
+size_t PsychicWebSocketQueue::bytes()
+{
+  xSemaphoreTake(_lock, portMAX_DELAY);
+  size_t bytes = _bytes;
+  xSemaphoreGive(_lock);
+  return bytes;
+}
+
+uint32_t PsychicWebSocketQueue::dropped()
+{
+  xSemaphoreTake(_lock, portMAX_DELAY);
+  uint32_t dropped = _dropped;
+  xSemaphoreGive(_lock);
+  return dropped;
+}
+
+/*************************************/
+/*  PsychicWebSocketClient   */
+/*************************************/
+
+PsychicWebSocketClient::PsychicWebSocketClient(PsychicClient* client)
+    : PsychicClient(client->server(), client->socket()),
+      _queue(new PsychicWebSocketQueue(client->server(), client->socket()))
+{
+}
+
+PsychicWebSocketClient::~PsychicWebSocketClient()
+{
+  _queue->close();
+  _queue->release();
+}
+
+PsychicWebSocketClient* PsychicWebSocketClient::setQueueLimits(size_t messages, size_t bytes, PsychicWebSocketQueuePolicy policy)
+{
+  _queue->setLimits(messages, bytes, policy);
+  return this;
+}
+
+size_t PsychicWebSocketClient::queueLength()
+{
+  return _queue->length();
+}
+
+size_t PsychicWebSocketClient::queueBytes()
+{
+  return _queue->bytes();
+}
+
+uint32_t PsychicWebSocketClient::queueDropped()
+{
+  return _queue->dropped();
 }
 
 esp_err_t PsychicWebSocketClient::sendMessage(httpd_ws_frame_t* ws_pkt)
@@ -107,37 +385,21 @@ esp_err_t PsychicWebSocketClient::sendMessage(httpd_ws_frame_t* ws_pkt)
 
 esp_err_t PsychicWebSocketClient::sendMessage(httpd_ws_type_t op, const void* data, size_t len)
 {
-  // init our frame.
-  httpd_ws_frame_t* ws_pkt = (httpd_ws_frame_t*)malloc(sizeof(httpd_ws_frame_t));
-  if (ws_pkt == NULL) {
-    ESP_LOGE(PH_TAG, "Websocket: out of memory");
+  PsychicWebSocketPayload* payload = PsychicWebSocketPayload::create(op, data, len);
+  if (payload == NULL)
     return ESP_ERR_NO_MEM;
-  }
-  memset(ws_pkt, 0, sizeof(httpd_ws_frame_t)); // zero the datastructure out
 
-  // allocate for event text
-  ws_pkt->payload = (uint8_t*)malloc(len);
-  if (ws_pkt->payload == NULL) {
-    ESP_LOGE(PH_TAG, "Websocket: out of memory");
-    free(ws_pkt); // free our other memory
-    return ESP_ERR_NO_MEM;
-  }
-  memcpy(ws_pkt->payload, data, len);
-
-  ws_pkt->len = len;
-  ws_pkt->type = op;
-
-  esp_err_t err = httpd_ws_send_data_async(server(), socket(), ws_pkt, PsychicWebSocketClient::_sendMessageCallback, ws_pkt);
-
-  // take care of memory
-  if (err != ESP_OK) {
-    free(ws_pkt->payload);
-    free(ws_pkt);
-  }
+  esp_err_t err = sendMessage(payload);
+  payload->release();
 
   return err;
 }
 
+esp_err_t PsychicWebSocketClient::sendMessage(PsychicWebSocketPayload* payload)
+{
+  return _queue->push(payload);
+}
+
 esp_err_t PsychicWebSocketClient::sendMessage(const char* buf)
 {
   return this->sendMessage(HTTPD_WS_TYPE_TEXT, buf, strlen(buf));
@@ -146,7 +408,10 @@ esp_err_t PsychicWebSocketClient::sendMessage(const char* buf)
 PsychicWebSocketHandler::PsychicWebSocketHandler() : PsychicHandler(),
                                                      _onOpen(NULL),
                                                      _onFrame(NULL),
-                                                     _onClose(NULL)
+                                                     _onClose(NULL),
+                                                     _maxMessages(PSYCHIC_WS_QUEUE_MESSAGES),
+                                                     _maxBytes(PSYCHIC_WS_QUEUE_BYTES),
+                                                     _policy(PSYCHIC_WS_QUEUE_POLICY)
 {
 }
 
@@ -174,7 +439,9 @@ PsychicWebSocketClient* PsychicWebSocketHandler::getClient(PsychicClient* client
 
 void PsychicWebSocketHandler::addClient(PsychicClient* client)
 {
-  client->_friend = new PsychicWebSocketClient(client);
+  PsychicWebSocketClient* buddy = new PsychicWebSocketClient(client);
+  buddy->setQueueLimits(_maxMessages, _maxBytes, _policy);
+  client->_friend = buddy;
   PsychicHandler::addClient(client);
 }
 
@@ -343,7 +610,21 @@ PsychicWebSocketHandler* PsychicWebSocketHandler::onClose(PsychicWebSocketClient
   return this;
 }
 
-void PsychicWebSocketHandler::sendAll(httpd_ws_frame_t* ws_pkt)
+PsychicWebSocketHandler* PsychicWebSocketHandler::setQueueLimits(size_t messages, size_t bytes, PsychicWebSocketQueuePolicy policy)
+{
+  _maxMessages = messages;
+  _maxBytes = bytes;
+  _policy = policy;
+
+  for (PsychicClient* client : _clients) {
+    if (client->_friend != NULL)
+      ((PsychicWebSocketClient*)client->_friend)->setQueueLimits(messages, bytes, policy);
+  }
+
+  return this;
+}
+
+void PsychicWebSocketHandler::sendAll(PsychicWebSocketPayload* payload)
 {
   for (PsychicClient* client : _clients) {
     // ESP_LOGD(PH_TAG, "Active client (fd=%d) -> sending async message", client->socket());
@@ -352,11 +633,22 @@ void PsychicWebSocketHandler::sendAll(httpd_ws_frame_t* ws_pkt)
       continue;
     }
 
-    if (((PsychicWebSocketClient*)client->_friend)->sendMessage(ws_pkt) != ESP_OK)
-      break;
+    // a full or failing client only loses its own copy
+    ((PsychicWebSocketClient*)client->_friend)->sendMessage(payload);
   }
 }
 
+void PsychicWebSocketHandler::sendAll(httpd_ws_frame_t* ws_pkt)
+{
+  // one copy for everyone, freed when the last client is done with it
+  PsychicWebSocketPayload* payload = PsychicWebSocketPayload::create(ws_pkt->type, ws_pkt->payload, ws_pkt->len);
+  if (payload == NULL)
+    return;
+
+  this->sendAll(payload);
+  payload->release();
+}
+
 void PsychicWebSocketHandler::sendAll(httpd_ws_type_t op, const void* data, size_t len)
 {
   httpd_ws_frame_t ws_pkt;
@@ -3,9 +3,31 @@
 
 #include "PsychicCore.h"
 #include "PsychicRequest.h"
+#include <atomic>
 
 class PsychicWebSocketRequest;
 class PsychicWebSocketClient;
+class PsychicWebSocketQueue;
+
+// Each client sends one message at a time and queues the rest, up to this many messages or bytes.
+// A message is always accepted when nothing else is waiting, however big it is.
+#ifndef PSYCHIC_WS_QUEUE_MESSAGES
+  #define PSYCHIC_WS_QUEUE_MESSAGES 16
+#endif
+#ifndef PSYCHIC_WS_QUEUE_BYTES
+  #define PSYCHIC_WS_QUEUE_BYTES 16384
+#endif
+
+// what a full queue does with one more message
+enum PsychicWebSocketQueuePolicy {
+  WS_QUEUE_DROP_OLDEST, // drop the oldest waiting messages to make room
+  WS_QUEUE_DROP_NEWEST, // refuse the new message
+  WS_QUEUE_DISCONNECT   // refuse it and close the connection, the client is too slow to keep
+};
+
+#ifndef PSYCHIC_WS_QUEUE_POLICY
+  #define PSYCHIC_WS_QUEUE_POLICY WS_QUEUE_DROP_OLDEST
+#endif
 
 #ifdef PSYCHIC_WS_RX_STATIC_BUFFER
 // Pre-allocate the shared WS RX buffer once while the heap is still fresh.
@@ -17,24 +39,65 @@ extern "C" void psychic_ws_preinit_rx_buf();
 typedef std::function<void(PsychicWebSocketClient* client)> PsychicWebSocketClientCallback;
 typedef std::function<esp_err_t(PsychicWebSocketRequest* request, httpd_ws_frame* frame)> PsychicWebSocketFrameCallback;
 
+// An outgoing frame with its payload in one block, shared by every send that queues it. Each
+// queued send holds a reference and the last one to complete frees it, so sendAll() copies the
+// payload once however many clients there are.
+class PsychicWebSocketPayload
+{
+  private:
+    std::atomic<uint32_t> _refs;
+    httpd_ws_frame_t _frame;
+
+    PsychicWebSocketPayload(httpd_ws_type_t op, size_t len);
+
+  public:
+    // a copy of data with one reference, nullptr if out of memory
+    static PsychicWebSocketPayload* create(httpd_ws_type_t op, const void* data, size_t len);
+
+    PsychicWebSocketPayload(const PsychicWebSocketPayload&) = delete;
+    PsychicWebSocketPayload& operator=(const PsychicWebSocketPayload&) = delete;
+
+    void retain();
+    void release();
+
+    httpd_ws_frame_t* frame() { return &_frame; }
+    size_t length() const { return _frame.len; }
+};
+
 class PsychicWebSocketClient : public PsychicClient
 {
   protected:
-    static void _sendMessageCallback(esp_err_t err, int socket, void* arg);
+    PsychicWebSocketQueue* _queue;
 
   public:
     PsychicWebSocketClient(PsychicClient* client);
     ~PsychicWebSocketClient();
 
+    PsychicWebSocketClient(const PsychicWebSocketClient&) = delete;
+    PsychicWebSocketClient& operator=(const PsychicWebSocketClient&) = delete;
+
+    PsychicWebSocketClient* setQueueLimits(size_t messages, size_t bytes, PsychicWebSocketQueuePolicy policy = PSYCHIC_WS_QUEUE_POLICY);
+
+    // messages waiting or being sent, and their payload bytes
+    size_t queueLength();
+    size_t queueBytes();
+    // messages dropped by the queue policy or because they couldn't be sent
+    uint32_t queueDropped();
+
+    // queue a message, ESP_ERR_NO_MEM if the queue refused it and ESP_FAIL if it closed the connection
     esp_err_t sendMessage(httpd_ws_frame_t* ws_pkt);
     esp_err_t sendMessage(httpd_ws_type_t op, const void* data, size_t len);
     esp_err_t sendMessage(const char* buf);
+    // queue a shared payload, it takes its own reference
+    esp_err_t sendMessage(PsychicWebSocketPayload* payload);
 };
 
 class PsychicWebSocketRequest : public PsychicRequest
 {
   private:
-    PsychicWebSocketClient _client;
+    // the handler's client for this socket, so replies share its send queue
+    PsychicWebSocketClient* _client;
+    std::unique_ptr<PsychicWebSocketClient> _ownClient; // only if the handler has none
 
   public:
     PsychicWebSocketRequest(PsychicRequest* req);
@@ -54,6 +117,10 @@ class PsychicWebSocketHandler : public PsychicHandler
     PsychicWebSocketFrameCallback _onFrame;
     PsychicWebSocketClientCallback _onClose;
 
+    size_t _maxMessages;
+    size_t _maxBytes;
+    PsychicWebSocketQueuePolicy _policy;
+
   public:
     PsychicWebSocketHandler();
     ~PsychicWebSocketHandler();
@@ -72,6 +139,12 @@ class PsychicWebSocketHandler : public PsychicHandler
     PsychicWebSocketHandler* onFrame(PsychicWebSocketFrameCallback fn);
     PsychicWebSocketHandler* onClose(PsychicWebSocketClientCallback fn);
 
+    // send queue limits for every client, connected or not yet
+    PsychicWebSocketHandler* setQueueLimits(size_t messages, size_t bytes, PsychicWebSocketQueuePolicy policy = PSYCHIC_WS_QUEUE_POLICY);
+
+    // queue a message for every client, a client whose queue refuses it doesn't hold up the others
+
+    void sendAll(PsychicWebSocketPayload* payload);
     void sendAll(httpd_ws_frame_t* ws_pkt);
     void sendAll(httpd_ws_type_t op, const void* data, size_t len);
     void sendAll(const char* buf);
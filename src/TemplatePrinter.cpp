@@ -83,13 +83,42 @@ size_t TemplatePrinter::write(uint8_t data)
   return 1;
 }
 
+size_t TemplatePrinter::write(const uint8_t* buffer, size_t size)
+{
+  const uint8_t* end = buffer + size;
+
+  while (buffer < end) {
+    // collecting a parameter name goes byte by byte
+    if (_inParam) {
+      write(*buffer++);
+      continue;
+    }
+
+    // otherwise pass everything up to the next delimiter through in one go
+    const uint8_t* delim = (const uint8_t*)memchr(buffer, _delimiter, end - buffer);
+    const uint8_t* spanEnd = delim ? delim : end;
+    if (spanEnd > buffer)
+      _stream.write(buffer, spanEnd - buffer);
+
+    buffer = spanEnd;
+    if (delim)
+      write(*buffer++);
+  }
+
+  return size;
+}
+
 #ifdef ARDUINO
 size_t TemplatePrinter::copyFrom(Stream& stream)
 {
   size_t count = 0;
+  uint8_t buffer[128];
 
-  while (stream.available())
-    count += this->write(stream.read());
+  while (stream.available() > 0) {
+    // only ask for what is there, readBytes() waits out the stream timeout for the rest
+    size_t readBytes = stream.readBytes(buffer, std::min(sizeof(buffer), (size_t)stream.available()));
+    count += this->write(buffer, readBytes);
+  }
 
   return count;
 }
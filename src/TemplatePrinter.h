@@ -47,6 +47,7 @@ class TemplatePrinter : public Print
 
     void flush() override;
     size_t write(uint8_t data) override;
+    size_t write(const uint8_t* buffer, size_t size) override;
 #ifdef ARDUINO
     size_t copyFrom(Stream& stream);
 #endif
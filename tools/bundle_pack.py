@@ -0,0 +1,148 @@
+#!/usr/bin/env python3
+"""Pack a web root into one image for PsychicBundleHandler.
+
+Every file becomes an entry with its content type and a strong ETag worked out
+here, so the device only has to look them up. A precompressed sibling
+(app.js.gz, app.js.br) is stored as another encoding of app.js instead of a
+file of its own; --gzip adds a gzip copy of every compressible file that does
+not have one, when it comes out smaller.
+
+    python tools/bundle_pack.py data/www -o www.bin --gzip
+    parttool.py write_partition --partition-name www --input www.bin
+
+The partition table needs a data partition big enough for the image, e.g.
+
+    www, data, undefined, , 512K
+"""
+
+import argparse
+import gzip
+import hashlib
+import os
+import struct
+import sys
+
+MAGIC = b"PSYB"
+VERSION = 1
+HEADER = struct.Struct("<4sHHI")
+ENTRY = struct.Struct("<IIIIIB3x")
+
+IDENTITY, GZIP, BR = 0, 1, 2
+SUFFIXES = {".gz": GZIP, ".br": BR}
+
+# same table as PsychicFileResponse
+CONTENT_TYPES = [
+    (".html", "text/html"),
+    (".htm", "text/html"),
+    (".css", "text/css"),
+    (".json", "application/json"),
+    (".js", "application/javascript"),
+    (".png", "image/png"),
+    (".gif", "image/gif"),
+    (".jpg", "image/jpeg"),
+    (".ico", "image/x-icon"),
+    (".svg", "image/svg+xml"),
+    (".eot", "font/eot"),
+    (".woff", "font/woff"),
+    (".woff2", "font/woff2"),
+    (".ttf", "font/ttf"),
+    (".xml", "text/xml"),
+    (".pdf", "application/pdf"),
+    (".zip", "application/zip"),
+    (".gz", "application/x-gzip"),
+]
+
+# already compressed formats gain nothing from gzip
+INCOMPRESSIBLE = (".png", ".gif", ".jpg", ".woff", ".woff2", ".zip", ".gz", ".br", ".pdf")
+
+
+def content_type(path):
+    for suffix, mime in CONTENT_TYPES:
+        if path.endswith(suffix):
+            return mime
+    return "text/plain"
+
+
+def collect(root, add_gzip):
+    """Returns {path: {encoding: bytes}}."""
+    files = {}
+    for folder, _, names in os.walk(root):
+        for name in names:
+            full = os.path.join(folder, name)
+            rel = "/" + os.path.relpath(full, root).replace(os.sep, "/")
+            base, ext = os.path.splitext(rel)
+            encoding = SUFFIXES.get(ext, IDENTITY)
+            if encoding == IDENTITY:
+                base = rel
+            with open(full, "rb") as f:
+                files.setdefault(base, {})[encoding] = f.read()
+
+    if add_gzip:
+        for path, variants in files.items():
+            if GZIP in variants or IDENTITY not in variants or path.endswith(INCOMPRESSIBLE):
+                continue
+            packed = gzip.compress(variants[IDENTITY], 9, mtime=0)
+            if len(packed) < len(variants[IDENTITY]):
+                variants[GZIP] = packed
+
+    return files
+
+
+def pack(files):
+    entries = []
+    for path in sorted(files, key=lambda p: p.encode()):
+        for encoding in sorted(files[path]):
+            entries.append((path, encoding, files[path][encoding]))
+    if len(entries) > 0xFFFF:
+        sys.exit("too many files for one bundle")
+
+    # string table, shared between entries where it can be
+    strings = bytearray()
+    offsets = {}
+    table_start = HEADER.size + ENTRY.size * len(entries)
+
+    def string(value):
+        if value not in offsets:
+            offsets[value] = table_start + len(strings)
+            strings.extend(value.encode() + b"\0")
+        return offsets[value]
+
+    rows = []
+    for path, encoding, data in entries:
+        etag = '"%s"' % hashlib.sha256(data).hexdigest()[:16]
+        rows.append([string(path), string(content_type(path)), string(etag), 0, len(data), encoding])
+
+    # data blobs start 4 byte aligned
+    blobs = bytearray()
+    data_start = (table_start + len(strings) + 3) & ~3
+    for row, (_, _, data) in zip(rows, entries):
+        row[3] = data_start + len(blobs)
+        blobs.extend(data)
+        blobs.extend(b"\0" * (-len(blobs) % 4))
+
+    size = data_start + len(blobs)
+    image = bytearray(HEADER.pack(MAGIC, VERSION, len(entries), size))
+    for row in rows:
+        image.extend(ENTRY.pack(*row))
+    image.extend(strings)
+    image.extend(b"\0" * (data_start - len(image)))
+    image.extend(blobs)
+    return image, entries
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("root", help="web root, e.g. data/www")
+    parser.add_argument("-o", "--output", default="www.bin", help="image file (default: www.bin)")
+    parser.add_argument("--gzip", action="store_true", help="add a gzip copy of compressible files")
+    args = parser.parse_args()
+
+    image, entries = pack(collect(args.root, args.gzip))
+    with open(args.output, "wb") as f:
+        f.write(image)
+
+    print("%s: %d entries, %d bytes" % (args.output, len(entries), len(image)))
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,98 @@
+#!/usr/bin/env python3
+"""Compile a web root into a C++ header for PsychicAssetHandler.
+
+Writes one constexpr PsychicAsset table (path, content type, ETag, data,
+length, encoding), sorted the way the handler searches it, plus the file
+contents as const arrays so they stay in flash. Precompressed siblings
+(app.js.gz, app.js.br) and --gzip copies become encodings of app.js, exactly
+as with tools/bundle_pack.py.
+
+    python tools/embed_assets.py data/www -o src/www_assets.h --gzip
+
+Include the header in one source file only:
+
+    #include "www_assets.h"
+    server.addHandler(new PsychicAssetHandler("/", www_assets));
+"""
+
+import argparse
+import hashlib
+import os
+import re
+import sys
+
+sys.path.insert(0, os.path.dirname(os.path.abspath(__file__)))
+from bundle_pack import collect, content_type  # noqa: E402
+
+ENCODINGS = ["ASSET_IDENTITY", "ASSET_GZIP", "ASSET_BR"]
+
+
+def c_string(value):
+    return '"%s"' % value.replace("\\", "\\\\").replace('"', '\\"')
+
+
+def c_bytes(data, indent="  "):
+    lines = []
+    for i in range(0, len(data), 16):
+        lines.append(indent + ", ".join("0x%02x" % b for b in data[i : i + 16]) + ",")
+    return "\n".join(lines) if lines else indent + "0x00,"
+
+
+def generate(files, name, source):
+    entries = []
+    for path in sorted(files, key=lambda p: p.encode()):
+        for encoding in sorted(files[path]):
+            entries.append((path, encoding, files[path][encoding]))
+
+    guard = name.upper() + "_ASSETS_H"
+    out = []
+    out.append("// generated by tools/embed_assets.py from %s, do not edit" % source)
+    out.append("#ifndef %s" % guard)
+    out.append("#define %s" % guard)
+    out.append("")
+    out.append('#include "PsychicAssetHandler.h"')
+    out.append("")
+
+    for i, (path, encoding, data) in enumerate(entries):
+        out.append("// %s (%s, %d bytes)" % (path, ENCODINGS[encoding], len(data)))
+        out.append("alignas(4) static const uint8_t %s_data_%d[] = {" % (name, i))
+        out.append(c_bytes(data))
+        out.append("};")
+        out.append("")
+
+    out.append("static constexpr PsychicAsset %s_assets[] = {" % name)
+    for i, (path, encoding, data) in enumerate(entries):
+        etag = '\\"%s\\"' % hashlib.sha256(data).hexdigest()[:16]
+        out.append(
+            '  {%s, %s, "%s", %s_data_%d, %d, %s},'
+            % (c_string(path), c_string(content_type(path)), etag, name, i, len(data), ENCODINGS[encoding])
+        )
+    out.append("};")
+    out.append("")
+    out.append('static_assert(psychicAssetsSorted(%s_assets, %d), "%s_assets must be sorted by path");' % (name, len(entries), name))
+    out.append("")
+    out.append("#endif // %s" % guard)
+    out.append("")
+    return "\n".join(out), len(entries)
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("root", help="web root, e.g. data/www")
+    parser.add_argument("-o", "--output", default="www_assets.h", help="header file (default: www_assets.h)")
+    parser.add_argument("-n", "--name", default="www", help="prefix of the generated symbols (default: www)")
+    parser.add_argument("--gzip", action="store_true", help="add a gzip copy of compressible files")
+    args = parser.parse_args()
+
+    if not re.match(r"^[A-Za-z_][A-Za-z0-9_]*$", args.name):
+        sys.exit("--name must be a C identifier")
+
+    header, count = generate(collect(args.root, args.gzip), args.name, args.root)
+    with open(args.output, "w", newline="\n") as f:
+        f.write(header)
+
+    print("%s: %d assets" % (args.output, count))
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,61 @@
+#!/usr/bin/env python3
+"""Write a content-hash manifest for PsychicStaticFileHandler::setEtagManifest().
+
+Every file under the web root gets one "<hash> <path>" line, where hash is the
+first 64 bits of its SHA-256 in hex and path is relative to the root with a
+leading '/'. Precompressed variants (.gz, .br) are listed as files of their own
+so each representation gets its own strong ETag.
+
+    python tools/etag_manifest.py data/www            # writes data/www/.etags
+    python tools/etag_manifest.py data/www -o other.txt
+"""
+
+import argparse
+import hashlib
+import os
+import sys
+
+MANIFEST_NAME = ".etags"
+
+
+def file_hash(path):
+    digest = hashlib.sha256()
+    with open(path, "rb") as f:
+        for block in iter(lambda: f.read(65536), b""):
+            digest.update(block)
+    return digest.hexdigest()[:16]
+
+
+def build_manifest(root, skip):
+    entries = []
+    for folder, _, files in os.walk(root):
+        for name in files:
+            full = os.path.join(folder, name)
+            if os.path.abspath(full) == skip:
+                continue
+            rel = "/" + os.path.relpath(full, root).replace(os.sep, "/")
+            if " " in rel or "\n" in rel:
+                print("skipping %s: spaces are not supported in manifest paths" % rel, file=sys.stderr)
+                continue
+            entries.append((rel, file_hash(full)))
+    return sorted(entries)
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("root", help="web root that is uploaded to the filesystem, e.g. data/www")
+    parser.add_argument("-o", "--output", help="manifest file (default: <root>/%s)" % MANIFEST_NAME)
+    args = parser.parse_args()
+
+    output = args.output or os.path.join(args.root, MANIFEST_NAME)
+    entries = build_manifest(args.root, os.path.abspath(output))
+
+    with open(output, "w", newline="\n") as f:
+        for path, digest in entries:
+            f.write("%s %s\n" % (digest, path))
+
+    print("%s: %d files" % (output, len(entries)))
+
+
+if __name__ == "__main__":
+    main()
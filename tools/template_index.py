@@ -0,0 +1,78 @@
+#!/usr/bin/env python3
+"""Write placeholder indexes for the *.tpl.* files of a web root.
+
+PsychicStaticFileHandler::setTemplateCallback() renders every file named like
+settings.tpl.html. Without an index it scans the file once for %NAME%
+placeholders on first use; with one next to it (settings.tpl.html.idx) it
+skips the scan. Run this again whenever a template changes, an index that
+doesn't match the file's size or placeholders is ignored.
+
+    python tools/template_index.py data/www
+    python tools/template_index.py data/www --delimiter '$'
+"""
+
+import argparse
+import os
+import re
+import sys
+
+NAME = re.compile(rb"[A-Za-z0-9_]{1,63}")
+
+
+def scan(data, delimiter):
+    """(offset, length, name) of each placeholder, read the way TemplatePrinter reads them."""
+    delim = delimiter.encode()
+    found = []
+    pos = 0
+    while True:
+        start = data.find(delim, pos)
+        if start < 0:
+            return found
+        end = start + 1
+        while end < len(data) and end - start <= 63 and (data[end : end + 1].isalnum() or data[end : end + 1] == b"_"):
+            end += 1
+        if end >= len(data):
+            return found
+        # anything but %NAME% is text, and a closing delimiter doesn't open the next one
+        if data[end : end + 1] != delim:
+            pos = end
+            continue
+        pos = end + 1
+        if end > start + 1:
+            found.append((start, pos - start, data[start + 1 : end].decode()))
+
+
+def write_index(path, delimiter):
+    with open(path, "rb") as f:
+        data = f.read()
+    placeholders = scan(data, delimiter)
+    with open(path + ".idx", "w", newline="\n") as f:
+        f.write("# generated by tools/template_index.py, do not edit\n")
+        f.write("size %d\n" % len(data))
+        for offset, length, name in placeholders:
+            f.write("%d %d %s\n" % (offset, length, name))
+    return len(placeholders)
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("root", help="web root (or a single template), e.g. data/www")
+    parser.add_argument("--delimiter", default="%", help="placeholder delimiter (default: %%)")
+    args = parser.parse_args()
+
+    if len(args.delimiter) != 1:
+        sys.exit("--delimiter must be one character")
+
+    if os.path.isfile(args.root):
+        paths = [args.root]
+    else:
+        paths = []
+        for folder, _, files in os.walk(args.root):
+            paths += [os.path.join(folder, name) for name in files if ".tpl." in name and not name.endswith(".idx")]
+
+    for path in sorted(paths):
+        print("%s: %d placeholders" % (path, write_index(path, args.delimiter)))
+
+
+if __name__ == "__main__":
+    main()